@@ -0,0 +1,308 @@
+// Microbenchmarks of the parse, dispatch and report paths.
+// Every case runs a fixed workload several times and prints the best run, so the numbers are comparable between
+// builds of the same machine. The allocations are counted by the replaced global operator new.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "flp.h"
+using namespace finix;
+
+static size_t allocation_count = 0;
+// not inlined, or GCC sees malloc and free paired with a new expression and warns about a mismatch
+[[gnu::noinline]] void* operator new(size_t size) {
+  ++allocation_count;
+  if (void* p = std::malloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void* operator new[](size_t size) { return operator new(size); }
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete[](void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+constexpr int kRepeats = 5;
+
+// keep the compiler from dropping the benchmarked work
+volatile size_t sink_bytes = 0;
+OutputSink NullSink() {
+  return [](const char*, size_t len) { sink_bytes = sink_bytes + len; };
+}
+
+struct Result {
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+/// Run body(ops) kRepeats times after a warm-up and keep the fastest run.
+template <typename F>
+Result Measure(size_t ops, F&& body) {
+  body(ops);
+  Result best{1e300, 0};
+  for (int i = 0; i < kRepeats; ++i) {
+    auto allocs = allocation_count;
+    auto start = std::chrono::steady_clock::now();
+    body(ops);
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / static_cast<double>(ops);
+    if (ns < best.ns_per_op) {
+      best = {ns, static_cast<double>(allocation_count - allocs) / static_cast<double>(ops)};
+    }
+  }
+  return best;
+}
+
+void PrintHeader(const char* title, const char* unit) {
+  std::printf("\n### %s\n\n| case | ns/op | %s | allocs/op |\n|---|---:|---:|---:|\n", title, unit);
+}
+
+void PrintRow(const std::string& name, const Result& r, double per_second) {
+  std::printf("| %s | %.1f | %.3g | %.2f |\n", name.c_str(), r.ns_per_op, per_second, r.allocs_per_op);
+}
+
+/// Commands per second through ValidateApply, for a command with n_args integer arguments.
+void BenchDispatch() {
+  PrintHeader("ValidateApply", "commands/s");
+  const size_t kOps = 200000;
+  for (bool frozen : {false, true}) {
+    // 0: none, 1: CommandCallback, 2: CommandHandler
+    for (int callback : {0, 1, 2}) {
+      for (int n_args : {0, 1, 4, 8}) {
+        LineProtocol flp;
+        flp.SetOutputSink(NullSink());
+        std::vector<int> targets(n_args);
+        ArgumentMap arg_map;
+        std::string line = "bench.node.command";
+        for (int i = 0; i < n_args; ++i) {
+          auto name = "arg" + std::to_string(i);
+          arg_map.try_emplace(name, targets[i]);
+          line += " " + name + "=" + std::to_string(100 + i);
+        }
+        // a few neighbours, so the lookup is not trivial
+        for (int i = 0; i < 15; ++i) {
+          flp.RegisterCommand("bench.other" + std::to_string(i), {}, nullptr);
+        }
+        size_t calls = 0;
+        if (callback == 2) {
+          flp.RegisterCommand("bench.node.command", arg_map, [&](const CommandArguments&) { ++calls; });
+        } else {
+          flp.RegisterCommand("bench.node.command", arg_map,
+                              callback ? CommandCallback([&](const RawArgumentMap&, const RawArgumentMap&) { ++calls; })
+                                       : CommandCallback(nullptr));
+        }
+        if (frozen) {
+          flp.Freeze();
+        }
+        auto r = Measure(kOps, [&](size_t ops) {
+          for (size_t i = 0; i < ops; ++i) {
+            flp.ValidateApply(line);
+          }
+        });
+        char name[64];
+        std::snprintf(name, sizeof(name), "%d args%s%s", n_args, frozen ? ", frozen" : "",
+                      callback == 2 ? ", handler" : callback ? ", callback" : "");
+        PrintRow(name, r, 1e9 / r.ns_per_op);
+      }
+    }
+  }
+}
+
+/// Lookups per second with thousands of registered commands, for a hit and for a miss on the first segment.
+void BenchRouting() {
+  PrintHeader("Routing, 4096 commands", "commands/s");
+  const size_t kOps = 200000;
+  for (bool frozen : {false, true}) {
+    LineProtocol flp;
+    flp.SetOutputSink(NullSink());
+    for (int i = 0; i < 64; ++i) {
+      for (int j = 0; j < 64; ++j) {
+        flp.RegisterCommand("node" + std::to_string(i) + ".command" + std::to_string(j), {}, nullptr);
+      }
+    }
+    if (frozen) {
+      flp.Freeze();
+    }
+    for (bool hit : {true, false}) {
+      const char* line = hit ? "node42.command17" : "unknown.command17";
+      auto r = Measure(kOps, [&](size_t ops) {
+        for (size_t i = 0; i < ops; ++i) {
+#ifdef __EXCEPTIONS
+          try {
+            flp.ValidateApply(line);
+          } catch (const UnknownQualifierError&) {
+          }
+#else
+          flp.ValidateApply(line);
+#endif
+        }
+      });
+      char name[64];
+      std::snprintf(name, sizeof(name), "%s%s", hit ? "hit" : "miss, throws", frozen ? ", frozen" : "");
+      PrintRow(name, r, 1e9 / r.ns_per_op);
+    }
+  }
+}
+
+/// Registrations per second at boot: a command and a state each, through an ArgumentMap or a CommandDefinition, and
+/// with the reservation of the registry.
+void BenchRegistration() {
+  PrintHeader("Registration, 512 commands and states", "registrations/s");
+  const size_t kCount = 512;
+  std::vector<std::string> names;
+  for (size_t i = 0; i < kCount; ++i) {
+    names.push_back("node" + std::to_string(i / 16) + ".item" + std::to_string(i % 16));
+  }
+  int target = 0;
+  for (int mode : {0, 1, 2}) {
+    auto r = Measure(kCount, [&](size_t ops) {
+      LineProtocol flp;
+      if (mode == 2) {
+        flp.GetRegistry()->Reserve(ops, ops);
+      }
+      std::vector<std::unique_ptr<ExchangeState<int>>> states;
+      states.reserve(ops);
+      for (size_t i = 0; i < ops; ++i) {
+        if (mode == 0) {
+          flp.RegisterCommand(names[i], {{"value", ArgumentSpec(target)}}, nullptr);
+        } else {
+          flp.RegisterCommands({{names[i], {{"value", ArgumentSpec(target)}}, nullptr}});
+        }
+        states.push_back(std::make_unique<ExchangeState<int>>(flp, names[i]));
+      }
+    });
+    const char* name[] = {"ArgumentMap", "CommandDefinition", "CommandDefinition, reserved"};
+    PrintRow(name[mode], r, 1e9 / r.ns_per_op);
+  }
+}
+
+/// Bytes per second through Feed and ProcessAll, or through ProcessBuffer, when the input arrives in bursts of the given
+/// size.
+void BenchFeed() {
+  PrintHeader("Feed + ProcessAll, ProcessBuffer", "MB/s");
+  const std::string line = "motor.set speed=1200 accel=3.5 dir=1\n";
+  std::string input;
+  while (input.size() < (1 << 16)) {
+    input += line;
+  }
+  for (bool in_place : {false, true}) {
+    for (size_t burst : {1, 16, 64, 256, 4096}) {
+      LineProtocol flp;
+      flp.SetOutputSink(NullSink());
+      int speed, dir;
+      float accel;
+      flp.RegisterCommand("motor.set",
+                          {{"speed", ArgumentSpec(speed)}, {"accel", ArgumentSpec(accel)}, {"dir", ArgumentSpec(dir)}},
+                          nullptr);
+      flp.Freeze();
+      // ops are bytes here
+      auto r = Measure(input.size(), [&](size_t) {
+        for (size_t pos = 0; pos < input.size(); pos += burst) {
+          auto len = std::min(burst, input.size() - pos);
+          if (in_place) {
+            flp.ProcessBuffer(input.data() + pos, len);
+          } else {
+            flp.Feed(input.data() + pos, len);
+            flp.ProcessAll();
+          }
+        }
+      });
+      char name[64];
+      std::snprintf(name, sizeof(name), "burst %zu%s", burst, in_place ? ", ProcessBuffer" : "");
+      PrintRow(name, r, 1e3 / r.ns_per_op);
+    }
+  }
+}
+
+/// Bytes per second through Tokenize, for a short and a long command line.
+void BenchTokenize() {
+  PrintHeader(FLP_ENABLE_SIMD ? "Tokenize, SIMD" : "Tokenize, scalar", "MB/s");
+  const size_t kOps = 200000;
+  for (const char* line : {"motor.set speed=1200 accel=3.5 dir=1",
+                           "plant.tank.level.controller.set setpoint=1200.5 kp=0.125 ki=0.0025 kd=1.5e-3 "
+                           "limit_low=-1000 limit_high=1000 window=64 enable=1 mode=2"}) {
+    std::string_view view(line);
+    CommandTokens tokens;
+    auto r = Measure(kOps, [&](size_t ops) {
+      for (size_t i = 0; i < ops; ++i) {
+        Tokenize(view, tokens);
+        sink_bytes = sink_bytes + tokens.size();
+      }
+    });
+    char name[64];
+    std::snprintf(name, sizeof(name), "%zu bytes", view.size());
+    PrintRow(name, r, static_cast<double>(view.size()) * 1e3 / r.ns_per_op);
+  }
+}
+
+/// Responses per second through Respond.
+void BenchRespond() {
+  PrintHeader("Respond", "responses/s");
+  const size_t kOps = 500000;
+  LineProtocol flp;
+  flp.SetOutputSink(NullSink());
+  for (bool binary : {false, true}) {
+    flp.SetBinaryMode(binary);
+    auto r = Measure(kOps, [&](size_t ops) {
+      for (size_t i = 0; i < ops; ++i) {
+        flp.Respond("motor.status", "running");
+      }
+    });
+    PrintRow(binary ? "binary" : "text", r, 1e9 / r.ns_per_op);
+  }
+}
+
+template <typename T>
+void BenchReportOf(const char* type_name, bool binary, bool subscribed = true) {
+  const size_t kOps = 500000;
+  LineProtocol flp;
+  flp.SetOutputSink(NullSink());
+  flp.SetBinaryMode(binary);
+  ExchangeState<T> state(flp, "bench.state");
+  if (!subscribed) {
+    flp.Subscribe({}, false);
+  }
+  auto r = Measure(kOps, [&](size_t ops) {
+    for (size_t i = 0; i < ops; ++i) {
+      // every value differs from the previous one, so each Set reports
+      state.Set(static_cast<T>(i & 1));
+    }
+  });
+  char name[64];
+  std::snprintf(name, sizeof(name), "%s%s%s", type_name, binary ? ", binary" : "", subscribed ? "" : ", unsubscribed");
+  PrintRow(name, r, 1e9 / r.ns_per_op);
+}
+
+/// Reports per second through ExchangeState::Set for each supported T.
+void BenchReport() {
+  PrintHeader("ExchangeState::ReportState", "reports/s");
+  for (bool binary : {false, true}) {
+    BenchReportOf<bool>("bool", binary);
+    BenchReportOf<int>("int", binary);
+    BenchReportOf<uint32_t>("uint32_t", binary);
+    BenchReportOf<int64_t>("int64_t", binary);
+    BenchReportOf<float>("float", binary);
+    BenchReportOf<double>("double", binary);
+  }
+  BenchReportOf<int>("int", false, false);
+}
+}  // namespace
+
+int main() {
+  std::printf("FLP %s microbenchmarks, best of %d runs\n", FLP_VERSION, kRepeats);
+  BenchDispatch();
+  BenchRouting();
+  BenchRegistration();
+  BenchFeed();
+  BenchTokenize();
+  BenchRespond();
+  BenchReport();
+  return 0;
+}
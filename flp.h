@@ -6,34 +6,329 @@
 
 #define FLP_VERSION "1.1.2"
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <initializer_list>
 #include <iostream>
-#include <sstream>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <new>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
-#include <iomanip>
+#include <vector>
 #ifdef __EXCEPTIONS
 #define FLP_THROW(ex, msg) throw ex(msg)
 #else
 #define FLP_THROW(ex, msg) return false
 #endif
+// Clock of the timestamps when no source is set by LineProtocol::SetTimestampSource.
 #ifndef FLP_TIMESTAMP
 #define FLP_TIMESTAMP (std::chrono::duration_cast<std::chrono::milliseconds>(   \
                            std::chrono::system_clock::now().time_since_epoch()) \
                            .count())
 #endif
+// Floating-point std::from_chars is missing in older standard libraries; strtod is used instead.
+#ifndef FLP_HAS_FLOAT_FROM_CHARS
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define FLP_HAS_FLOAT_FROM_CHARS 1
+#else
+#define FLP_HAS_FLOAT_FROM_CHARS 0
+#endif
+#endif
+#ifndef FLP_HAS_FLOAT_TO_CHARS
+#define FLP_HAS_FLOAT_TO_CHARS FLP_HAS_FLOAT_FROM_CHARS
+#endif
+// Size of the buffer a response is formatted in. Longer responses are written to the sink in several chunks.
+#ifndef FLP_RESPONSE_BUFFER_SIZE
+#define FLP_RESPONSE_BUFFER_SIZE 128
+#endif
+// Storage size of the callables held by the setters, getters and validators.
+#ifndef FLP_FUNCTION_CAPACITY
+#define FLP_FUNCTION_CAPACITY (4 * sizeof(void*))
+#endif
+// Storage size of the command callbacks.
+#ifndef FLP_CALLBACK_CAPACITY
+#define FLP_CALLBACK_CAPACITY (8 * sizeof(void*))
+#endif
+// Maximum number of space separated tokens (qualifier included) in one command line.
+#ifndef FLP_MAX_TOKENS
+#define FLP_MAX_TOKENS 16
+#endif
+// Count the processed commands, the parse and dispatch times, the traffic and the reports, see @flp.stats.
+#ifndef FLP_ENABLE_STATS
+#define FLP_ENABLE_STATS 0
+#endif
+// Clock of the parse and dispatch time histograms, in nanoseconds.
+#ifndef FLP_STATS_CLOCK_NS
+#define FLP_STATS_CLOCK_NS (static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(   \
+                                                  std::chrono::steady_clock::now().time_since_epoch()) \
+                                                  .count()))
+#endif
+// Concurrent mode. One producer, such as an RX interrupt, feeds bytes through LineProtocol::QueueInput, and any thread
+// may respond or set an ExchangeState of a lock-free type through the output queue (LineProtocol::EnableOutputQueue).
+// Processing, registration and the coalesced reports stay on the thread that constructed the LineProtocol.
+#ifndef FLP_ENABLE_CONCURRENCY
+#define FLP_ENABLE_CONCURRENCY 0
+#endif
+// Asynchronous commands in flight per session, see CompletionToken.
+#ifndef FLP_MAX_INFLIGHT
+#define FLP_MAX_INFLIGHT 8
+#endif
+// Payload size of a cell of the output queue. A response takes as many consecutive cells as it needs.
+#ifndef FLP_OUTPUT_CELL_SIZE
+#define FLP_OUTPUT_CELL_SIZE 32
+#endif
+// Tokenize 16 bytes at a time with SSE2 or AArch64 NEON. 0 selects the portable scalar loops, e.g. on MCUs.
+#ifndef FLP_ENABLE_SIMD
+#if defined(__SSE2__) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define FLP_ENABLE_SIMD 1
+#else
+#define FLP_ENABLE_SIMD 0
+#endif
+#endif
+#if FLP_ENABLE_CONCURRENCY
+#include <atomic>
+#include <mutex>
+#include <thread>
+#endif
+#if FLP_ENABLE_SIMD
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
 
 namespace finix {
 // Forward declaration
 class LineProtocol;
+class CommandRegistry;
+class ExchangeStateBase;
 template <typename T>
 class ExchangeState;
 
+/// Type-erased callable stored in a fixed buffer, a non-allocating replacement of std::function. A callable larger than
+/// Capacity is a compile error; raise FLP_FUNCTION_CAPACITY or FLP_CALLBACK_CAPACITY if needed.
+template <typename Signature, size_t Capacity = FLP_FUNCTION_CAPACITY>
+class InplaceFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+  struct Ops {
+    R (*invoke)(void*, Args&&...);
+    void (*copy)(void* dst, const void* src);
+    void (*move)(void* dst, void* src);
+    void (*destroy)(void*);
+  };
+  template <typename F>
+  static constexpr Ops kOps{
+      [](void* f, Args&&... args) -> R { return (*static_cast<F*>(f))(std::forward<Args>(args)...); },
+      [](void* dst, const void* src) { new (dst) F(*static_cast<const F*>(src)); },
+      [](void* dst, void* src) { new (dst) F(std::move(*static_cast<F*>(src))); },
+      [](void* f) { static_cast<F*>(f)->~F(); },
+  };
+
+  alignas(std::max_align_t) unsigned char storage_[Capacity];
+  const Ops* ops_{nullptr};
+
+ public:
+  InplaceFunction() = default;
+  InplaceFunction(std::nullptr_t) {}
+  template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InplaceFunction> && std::is_invocable_r_v<R, std::decay_t<F>&, Args...>>>
+  InplaceFunction(F&& f) {
+    using Fn = std::decay_t<F>;
+    static_assert(sizeof(Fn) <= Capacity, "callable is too large for InplaceFunction");
+    static_assert(alignof(Fn) <= alignof(std::max_align_t), "callable is over-aligned for InplaceFunction");
+    if constexpr (std::is_constructible_v<bool, const Fn&>) {
+      // empty std::function or null function pointer
+      if (!static_cast<bool>(f)) {
+        return;
+      }
+    }
+    new (storage_) Fn(std::forward<F>(f));
+    ops_ = &kOps<Fn>;
+  }
+  InplaceFunction(const InplaceFunction& other) : ops_(other.ops_) {
+    if (ops_) {
+      ops_->copy(storage_, other.storage_);
+    }
+  }
+  InplaceFunction(InplaceFunction&& other) noexcept : ops_(other.ops_) {
+    if (ops_) {
+      ops_->move(storage_, other.storage_);
+    }
+  }
+  InplaceFunction& operator=(const InplaceFunction& other) {
+    if (this != &other) {
+      reset();
+      if (other.ops_) {
+        other.ops_->copy(storage_, other.storage_);
+        ops_ = other.ops_;
+      }
+    }
+    return *this;
+  }
+  InplaceFunction& operator=(InplaceFunction&& other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.ops_) {
+        other.ops_->move(storage_, other.storage_);
+        ops_ = other.ops_;
+      }
+    }
+    return *this;
+  }
+  InplaceFunction& operator=(std::nullptr_t) {
+    reset();
+    return *this;
+  }
+  ~InplaceFunction() { reset(); }
+
+  void reset() {
+    if (ops_) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+  explicit operator bool() const { return ops_ != nullptr; }
+  R operator()(Args... args) const {
+    return ops_->invoke(const_cast<unsigned char*>(storage_), std::forward<Args>(args)...);
+  }
+};
+
+/// Types of the values. In the binary frames the value follows its tag in little-endian byte order.
+enum class BinaryType : uint8_t {
+  kBool = 0,
+  kInt32 = 1,
+  kUint32 = 2,
+  kInt64 = 3,
+  kFloat = 4,
+  kDouble = 5,
+};
+
+template <typename T>
+constexpr BinaryType BinaryTypeOf() {
+  if constexpr (std::is_enum_v<T>) {
+    return BinaryTypeOf<std::underlying_type_t<T>>();
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return BinaryType::kBool;
+  } else if constexpr (std::is_integral_v<T> && sizeof(T) <= 4) {
+    return std::is_signed_v<T> ? BinaryType::kInt32 : BinaryType::kUint32;
+  } else if constexpr (std::is_integral_v<T>) {
+    return BinaryType::kInt64;
+  } else if constexpr (std::is_same_v<T, float>) {
+    return BinaryType::kFloat;
+  } else {
+    return BinaryType::kDouble;
+  }
+}
+
+/// Numeric value of an argument or a state. Integers are kept exactly instead of going through float, and the type
+/// records what the value was parsed, decoded or read as.
+struct NumericValue {
+  bool is_int{false};
+  // kInt64 or kDouble for the parsed text
+  BinaryType type{BinaryType::kDouble};
+  int64_t int_val{0};
+  double float_val{0};
+
+  template <typename T>
+  [[nodiscard]] T As() const {
+    return is_int ? static_cast<T>(int_val) : static_cast<T>(float_val);
+  }
+  template <typename T>
+  static NumericValue Of(T v) {
+    if constexpr (std::is_integral_v<T>) {
+      return {true, BinaryTypeOf<T>(), static_cast<int64_t>(v), static_cast<double>(v)};
+    } else {
+      return {false, BinaryTypeOf<T>(), 0, static_cast<double>(v)};
+    }
+  }
+};
+
+/// Parse a numeric argument value directly on the view. The integer scan stops at the first non-digit, and only values
+/// with a fraction or an exponent are passed to the floating-point parser.
+/// \return false if the value is not numeric.
+inline bool ParseNumericValue(std::string_view value, NumericValue& out) {
+  const char* first = value.data();
+  const char* last = first + value.size();
+  // from_chars does not take the leading '+'
+  if (first != last && *first == '+' && first + 1 != last && first[1] != '-') {
+    ++first;
+  }
+  if (first == last) {
+    return false;
+  }
+  auto int_result = std::from_chars(first, last, out.int_val);
+  if (int_result.ec == std::errc() && int_result.ptr == last) {
+    out.is_int = true;
+    out.type = BinaryType::kInt64;
+    out.float_val = static_cast<double>(out.int_val);
+    return true;
+  }
+  out.is_int = false;
+  out.type = BinaryType::kDouble;
+#if FLP_HAS_FLOAT_FROM_CHARS
+  auto float_result = std::from_chars(first, last, out.float_val);
+  return float_result.ec == std::errc() && float_result.ptr == last;
+#else
+  // strtod needs a null terminated string
+  char value_buf[32];
+  if (static_cast<size_t>(last - first) >= sizeof(value_buf)) {
+    return false;
+  }
+  std::memcpy(value_buf, first, last - first);
+  value_buf[last - first] = 0;
+  char* p;
+  out.float_val = strtod(value_buf, &p);
+  // if p points to the end of the string, conversion is successful
+  return *p == 0;
+#endif
+}
+
+using Validator = InplaceFunction<bool(double)>;
+using ArgumentSetter = InplaceFunction<void(const NumericValue&)>;
+/// Reads the current value of the target of an argument, so it can be restored by the setter.
+using ArgumentGetter = InplaceFunction<NumericValue()>;
+/// Receives the formatted output. A call carries a chunk of bytes that is not necessarily a whole line.
+using OutputSink = InplaceFunction<void(const char*, size_t)>;
+/// The float accessors of ExchangeState, kept for existing callers. The value goes through NumericValue.
+using ValueSetter = InplaceFunction<void(float)>;
+using ValueGetter = InplaceFunction<float()>;
+/// Non-blocking output, e.g. a DMA transfer or a socket send. It returns the number of leading bytes it took, 0 if it is
+/// busy. See BufferedOutput.
+using OutputWriter = InplaceFunction<size_t(const char*, size_t)>;
+/// Returns the timestamp of the responses, in any monotonic unit such as ticks or milliseconds.
+using TimestampSource = InplaceFunction<int64_t()>;
+
 // module functions
 template <typename T>
-std::function<bool(float)>& get_default_validator();
+Validator& get_default_validator();
+
+/// The range check of get_default_validator.
+template <typename T>
+constexpr bool IsInDefaultRange(double v) {
+  if constexpr (std::is_same_v<T, bool>) {
+    return (v == 0 || v == 1);
+  } else if constexpr (std::is_integral_v<T>) {
+    return (v >= std::numeric_limits<T>::min() && v <= std::numeric_limits<T>::max());
+  } else {
+    return true;
+  }
+}
 
 // Exceptions
 class UnknownQualifierError : public std::runtime_error {
@@ -48,368 +343,3729 @@ class ValidatorError : public std::runtime_error {
  public:
   explicit ValidatorError(const std::string& arg) : runtime_error(arg) {}
 };
+/// The callback rejected the command, see LineProtocol::RejectCommand.
+class CallbackError : public std::runtime_error {
+ public:
+  explicit CallbackError(const std::string& arg) : runtime_error(arg) {}
+};
 
 // Record classes
 struct ArgumentSpec {
   bool optional{true};
   bool is_float{false};
-  std::function<void(float)> setter;
-  std::function<bool(float)> validator{};
-  explicit ArgumentSpec(int& assign_to, bool optional = true, const std::function<bool(float)>& validator = nullptr)
-      : optional(optional),
-        is_float(false),
-        setter([&](float v) { assign_to = (int)v; }),
-        validator(std::move(validator)) {}
-  explicit ArgumentSpec(float& assign_to, bool optional = true, const std::function<bool(float)>& validator = nullptr)
-      : optional(optional),
-        is_float(true),
-        setter([&](float v) { assign_to = v; }),
-        validator(std::move(validator)) {}
+  // index of the argument in its command, assigned by CommandSpec
+  uint8_t slot{0};
+  // accepted range of an integer argument
+  int64_t int_min{std::numeric_limits<int64_t>::min()};
+  int64_t int_max{std::numeric_limits<int64_t>::max()};
+  ArgumentSetter setter;
+  // empty if the previous value cannot be restored
+  ArgumentGetter getter{};
+  Validator validator{};
+  explicit ArgumentSpec(int& assign_to, bool optional = true, const Validator& validator = nullptr)
+      : ArgumentSpec(assign_to, optional, validator, 0) {}
+  explicit ArgumentSpec(int64_t& assign_to, bool optional = true, const Validator& validator = nullptr)
+      : ArgumentSpec(assign_to, optional, validator, 0) {}
+  explicit ArgumentSpec(uint32_t& assign_to, bool optional = true, const Validator& validator = nullptr)
+      : ArgumentSpec(assign_to, optional, validator, 0) {}
+  explicit ArgumentSpec(float& assign_to, bool optional = true, const Validator& validator = nullptr)
+      : ArgumentSpec(assign_to, optional, validator, 0) {}
+  explicit ArgumentSpec(double& assign_to, bool optional = true, const Validator& validator = nullptr)
+      : ArgumentSpec(assign_to, optional, validator, 0) {}
+  explicit ArgumentSpec(bool& assign_to, bool optional = true, const Validator& validator = nullptr)
+      : ArgumentSpec(assign_to, optional, validator, 0) {}
 
   template <typename T>
-  explicit ArgumentSpec(ExchangeState<T>& assign_to, bool optional = true, const std::function<bool(float)>& validator = nullptr);
+  explicit ArgumentSpec(ExchangeState<T>& assign_to, bool optional = true, const Validator& validator = nullptr);
+
+ private:
+  template <typename T>
+  ArgumentSpec(T& assign_to, bool optional, const Validator& validator, int)
+      : optional(optional),
+        is_float(std::is_floating_point_v<T>),
+        setter([&assign_to](const NumericValue& v) { assign_to = v.As<T>(); }),
+        getter([&assign_to]() { return NumericValue::Of(assign_to); }),
+        validator(validator) {
+    if constexpr (std::is_integral_v<T>) {
+      int_min = std::numeric_limits<T>::min();
+      int_max = static_cast<int64_t>(std::min<uint64_t>(std::numeric_limits<T>::max(), std::numeric_limits<int64_t>::max()));
+    }
+  }
+};
+
+#if FLP_ENABLE_STATS
+/// Log2 histogram of durations. Bucket 0 counts the durations below 128 ns, bucket i those in [64 << i, 128 << i) ns
+/// and the last bucket everything longer.
+struct TimeHistogram {
+  static constexpr size_t kBuckets = 16;
+  std::array<uint32_t, kBuckets> buckets{};
+  void Add(uint64_t ns) {
+    size_t i = 0;
+    for (ns >>= 7; ns && i + 1 < kBuckets; ns >>= 1) {
+      ++i;
+    }
+    ++buckets[i];
+  }
+};
+struct CommandStats {
+  /// failed commands included
+  size_t processed{0};
+  size_t failed{0};
+};
+/// Counters of a LineProtocol, enabled by FLP_ENABLE_STATS.
+struct ProtocolStats {
+  CommandStats commands{};
+  TimeHistogram parse_time{};
+  TimeHistogram dispatch_time{};
+  size_t bytes_in{0};
+  size_t bytes_out{0};
+  /// maximum number of pending input bytes
+  size_t buffer_high_water{0};
+  size_t reports_emitted{0};
+  /// skipped by the deadband or because the value did not change
+  size_t reports_suppressed{0};
 };
+#endif
 
 using ArgumentMap = std::unordered_map<std::string, ArgumentSpec>;
 using RawArgumentMap = std::unordered_map<std::string, float>;
 /// Passing the predefined and undefined arguments.
-using CommandCallback = std::function<void(const RawArgumentMap&, const RawArgumentMap&)>;
+using CommandCallback = InplaceFunction<void(const RawArgumentMap&, const RawArgumentMap&), FLP_CALLBACK_CAPACITY>;
+
+/// An argument of the command line being dispatched.
+struct CommandArgument {
+  std::string_view name;
+  NumericValue value;
+  // nullptr if the argument is not in the spec.
+  const ArgumentSpec* spec;
+  [[nodiscard]] bool IsPredefined() const { return spec != nullptr; }
+};
+/// Bit i is set for the argument in slot i, see CommandSpec.
+using ArgumentMask = uint64_t;
+/// The predefined and undefined arguments of a command in the order of the line, with their exact values. The view
+/// refers to the line being dispatched and is valid during the callback only. A lookup scans the at most
+/// FLP_MAX_TOKENS arguments; no map is built.
+class CommandArguments {
+  const CommandArgument* begin_;
+  const CommandArgument* end_;
+  ArgumentMask supplied_;
+
+ public:
+  CommandArguments(const CommandArgument* args, size_t n, ArgumentMask supplied = 0) : begin_(args), end_(args + n), supplied_(supplied) {}
+  [[nodiscard]] size_t size() const { return static_cast<size_t>(end_ - begin_); }
+  [[nodiscard]] bool empty() const { return begin_ == end_; }
+  [[nodiscard]] const CommandArgument* begin() const { return begin_; }
+  [[nodiscard]] const CommandArgument* end() const { return end_; }
+  const CommandArgument& operator[](size_t i) const { return begin_[i]; }
+  /// \return the argument, the last one if it is repeated like its applied value, nullptr if it is not on the line.
+  [[nodiscard]] const CommandArgument* Find(std::string_view name) const {
+    for (auto it = end_; it != begin_;) {
+      if ((--it)->name == name) {
+        return it;
+      }
+    }
+    return nullptr;
+  }
+  [[nodiscard]] bool Has(std::string_view name) const { return Find(name) != nullptr; }
+  /// \return the predefined argument in the slot, the last one if it is repeated, nullptr if it is not on the line.
+  [[nodiscard]] const CommandArgument* AtSlot(size_t slot) const {
+    if (!IsSupplied(slot)) {
+      return nullptr;
+    }
+    for (auto it = end_; it != begin_;) {
+      if ((--it)->spec && it->spec->slot == slot) {
+        return it;
+      }
+    }
+    return nullptr;
+  }
+  [[nodiscard]] bool IsSupplied(size_t slot) const { return slot < 64 && (supplied_ >> slot & 1); }
+  [[nodiscard]] ArgumentMask Supplied() const { return supplied_; }
+  /// \return the value of the argument as T, or fallback if it is not on the line.
+  template <typename T>
+  [[nodiscard]] T Get(std::string_view name, T fallback = T{}) const {
+    auto* arg = Find(name);
+    return arg ? arg->value.As<T>() : fallback;
+  }
+};
+/// Receives the arguments as a CommandArguments view, see RegisterCommand.
+using CommandHandler = InplaceFunction<void(const CommandArguments&), FLP_CALLBACK_CAPACITY>;
+
+/// Finishes an asynchronous command. The handler of the command returns right away and keeps the token; the command
+/// stays in flight, listed by @flp.inflight, until Complete or Fail sends its final response to the session that
+/// dispatched it. A token is cheap to copy and only the first completion counts. The session must outlive the token.
+class CompletionToken {
+  LineProtocol* session_{nullptr};
+  uint32_t id_{0};
+
+ public:
+  CompletionToken() = default;
+  CompletionToken(LineProtocol* session, uint32_t id) : session_(session), id_(id) {}
+  [[nodiscard]] uint32_t GetId() const { return id_; }
+  [[nodiscard]] bool IsValid() const { return session_ != nullptr; }
+  /// Respond `message` with the `_` label on the channel of the command. On a thread other than the loop thread, the
+  /// session needs an output queue (EnableOutputQueue); without one, this asserts in debug builds and the command
+  /// stays in flight.
+  /// \return false if the command is not in flight anymore, or cannot be completed from this thread.
+  bool Complete(std::string_view message = "OK");
+  /// Respond `reason` with the `E` label instead. The arguments have been applied already and are not restored.
+  bool Fail(std::string_view reason);
+};
+/// An asynchronous command: it receives the arguments and the token that completes the command later.
+using AsyncCommandHandler = InplaceFunction<void(const CommandArguments&, CompletionToken), FLP_CALLBACK_CAPACITY>;
+
+/// The arguments of a command are numbered by slots in the order of their names, which are also their ids in the
+/// binary frames. The required arguments are checked with one mask comparison.
 struct CommandSpec {
-  ArgumentMap arg_map;
+  using allocator_type = std::pmr::polymorphic_allocator<char>;
+  /// Bound of the slots. A line carries at most FLP_MAX_TOKENS - 1 arguments, or ProcessLimits::max_tokens - 1, so a
+  /// command can have that many required arguments, and more only if they are optional.
+  static constexpr size_t kMaxArguments = 64;
+  // the copy of the ArgumentMap in the memory of the registry
+  std::pmr::unordered_map<std::pmr::string, ArgumentSpec> arg_map;
   CommandCallback callback;
-  CommandSpec(const ArgumentMap& arg_map, const CommandCallback& callback)
-      : arg_map(arg_map),
-        callback(callback) {}
+  CommandHandler handler;
+  AsyncCommandHandler async_handler;
+  ArgumentMask required_mask{0};
+  // key of the command in the CommandMap
+  std::string_view qualifier{};
+#if FLP_ENABLE_STATS
+  mutable CommandStats stats{};
+#endif
+  /// \param args an ArgumentMap or a list of ArgumentDefinition
+  template <typename Arguments>
+  CommandSpec(const Arguments& args, const CommandCallback& callback, const allocator_type& alloc = {})
+      : arg_map(alloc),
+        callback(callback) {
+    CopyArguments(args);
+  }
+  template <typename Arguments>
+  CommandSpec(const Arguments& args, const CommandHandler& handler, const allocator_type& alloc = {})
+      : arg_map(alloc),
+        handler(handler) {
+    CopyArguments(args);
+  }
+  template <typename Arguments>
+  CommandSpec(const Arguments& args, const AsyncCommandHandler& async_handler, const allocator_type& alloc = {})
+      : arg_map(alloc),
+        async_handler(async_handler) {
+    CopyArguments(args);
+  }
+  /// \return the argument in the slot, nullptr if there is none.
+  [[nodiscard]] const decltype(arg_map)::value_type* ArgumentAt(size_t slot) const {
+    for (auto& item : arg_map) {
+      if (item.second.slot == slot) {
+        return &item;
+      }
+    }
+    return nullptr;
+  }
+
+ private:
+  template <typename Arguments>
+  void CopyArguments(const Arguments& args) {
+    arg_map.reserve(args.size());
+    for (auto& item : args) {
+      arg_map.emplace(std::piecewise_construct, std::forward_as_tuple(item.first.data(), item.first.size()), std::forward_as_tuple(item.second));
+    }
+    for (auto& item : arg_map) {
+      size_t slot = 0;
+      for (auto& other : arg_map) {
+        slot += other.first < item.first;
+      }
+      item.second.slot = static_cast<uint8_t>(slot);
+      if (!item.second.optional && slot < kMaxArguments) {
+        required_mask |= ArgumentMask{1} << slot;
+      }
+    }
+  }
+};
+using CommandMap = std::pmr::unordered_map<std::pmr::string, CommandSpec>;
+
+using ArgumentDefinition = std::pair<std::string_view, ArgumentSpec>;
+/// One command of LineProtocol::RegisterCommands. Unlike an ArgumentMap, the arguments are copied straight into the
+/// registry, so a table of definitions does not allocate on its own.
+struct CommandDefinition {
+  std::string_view qualifier;
+  std::initializer_list<ArgumentDefinition> args;
+  CommandHandler handler;
 };
-using CommandMap = std::unordered_map<std::string, CommandSpec>;
 
 struct ExchangeStateInterface {
-  ExchangeStateInterface(std::function<float(void)> getter, std::function<void(float)> setter, bool is_float) : getter(std::move(getter)),
-                                                                                                                setter(std::move(setter)),
-                                                                                                                is_float(is_float) {}
-  std::function<float(void)> getter;
-  std::function<void(float)> setter;
+  ExchangeStateInterface(ArgumentGetter getter, ArgumentSetter setter, bool is_float, ExchangeStateBase* state = nullptr) : getter(std::move(getter)),
+                                                                                                                            setter(std::move(setter)),
+                                                                                                                            is_float(is_float),
+                                                                                                                            state(state) {}
+  // the value in its own type, see NumericValue::type
+  ArgumentGetter getter;
+  ArgumentSetter setter;
   bool is_float;
+  ExchangeStateBase* state;
 };
 
-using ExchangeStateMap = std::unordered_map<std::string, ExchangeStateInterface>;
+using ExchangeStateMap = std::pmr::unordered_map<std::pmr::string, ExchangeStateInterface>;
 
-// Classes
+/// Fixed-capacity list of tokens. The tokens are views into the tokenized line and do not own any memory.
+/// \tparam N maximum number of tokens
+template <size_t N>
+class TokenArray {
+  std::array<std::string_view, N> tokens_{};
+  // position of the first '=' in each token, npos if there is none
+  std::array<size_t, N> equals_{};
+  size_t size_{0};
 
-/// Represent the states that is managed by FLP. It can be used as the argument and the setter will be automatically adapted.
-/// When the setter is invoked, the state will be reported to the ostream.
-/// \tparam T
-template <typename T>
-class ExchangeState {
-  LineProtocol& flp_;
+ public:
+  static constexpr size_t capacity() { return N; }
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] bool empty() const { return size_ == 0; }
+  void clear() { size_ = 0; }
+  /// \return false if the array is full.
+  bool push_back(std::string_view token) {
+    return push_back(token, token.find('='));
+  }
+  bool push_back(std::string_view token, size_t equals) {
+    if (size_ == N) {
+      return false;
+    }
+    equals_[size_] = equals;
+    tokens_[size_++] = token;
+    return true;
+  }
+  const std::string_view& operator[](size_t i) const { return tokens_[i]; }
+  /// \return position of the first '=' in the token i, std::string_view::npos if there is none.
+  [[nodiscard]] size_t EqualsPos(size_t i) const { return equals_[i]; }
+  [[nodiscard]] const std::string_view* begin() const { return tokens_.data(); }
+  [[nodiscard]] const std::string_view* end() const { return tokens_.data() + size_; }
+};
+
+#if FLP_ENABLE_SIMD
+/// \return bit i set if p[i] == c, for the 16 bytes at p.
+inline uint32_t MatchMask16(const char* p, char c) {
+#if defined(__SSE2__)
+  auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c))));
+#else
+  static const uint8_t kBits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  auto eq = vceqq_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)), vdupq_n_u8(static_cast<uint8_t>(c)));
+  auto bits = vandq_u8(eq, vld1q_u8(kBits));
+  return vaddv_u8(vget_low_u8(bits)) | (static_cast<uint32_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+#endif
+}
+#endif
+
+/// Split the line by spaces. Consecutive, leading and tailing spaces are ignored. The position of the first '=' of
+/// each token is found in the same pass, see TokenArray::EqualsPos.
+/// \return false if the line contains more than N tokens.
+template <size_t N>
+bool Tokenize(std::string_view line, TokenArray<N>& tokens) {
+  tokens.clear();
+  constexpr size_t npos = std::string_view::npos;
+  const char* data = line.data();
+  // the current token starts at start, npos between the tokens
+  size_t start = npos;
+  size_t equals = npos;
+  size_t pos = 0;
+  auto end_token = [&](size_t end) {
+    bool ok = tokens.push_back(line.substr(start, end - start), equals == npos ? npos : equals - start);
+    start = equals = npos;
+    return ok;
+  };
+#if FLP_ENABLE_SIMD
+  for (; pos + 16 <= line.size(); pos += 16) {
+    uint32_t spaces = MatchMask16(data + pos, ' ');
+    uint32_t eqs = MatchMask16(data + pos, '=');
+    // bits of the block that are not consumed yet
+    uint32_t rest = 0xFFFF;
+    while (rest) {
+      if (start == npos) {
+        uint32_t words = ~spaces & rest;
+        if (!words) {
+          break;
+        }
+        auto first = static_cast<unsigned>(__builtin_ctz(words));
+        start = pos + first;
+        rest &= ~((1u << first) - 1);
+      } else {
+        uint32_t ends = spaces & rest;
+        uint32_t in_token = ends ? rest & ((1u << __builtin_ctz(ends)) - 1) : rest;
+        if (equals == npos && (eqs & in_token)) {
+          equals = pos + static_cast<unsigned>(__builtin_ctz(eqs & in_token));
+        }
+        if (!ends) {
+          break;
+        }
+        if (!end_token(pos + static_cast<unsigned>(__builtin_ctz(ends)))) {
+          return false;
+        }
+        rest &= ~in_token;
+      }
+    }
+  }
+#endif
+  for (; pos < line.size(); ++pos) {
+    char c = data[pos];
+    if (c == ' ') {
+      if (start != npos && !end_token(pos)) {
+        return false;
+      }
+    } else {
+      if (start == npos) {
+        start = pos;
+      }
+      if (c == '=' && equals == npos) {
+        equals = pos;
+      }
+    }
+  }
+  return start == npos || end_token(line.size());
+}
+using CommandTokens = TokenArray<FLP_MAX_TOKENS>;
 
+/// Flat, read-only snapshot of a CommandMap. The commands are sorted by the hash of their qualifier and the arguments
+/// of each command are stored contiguously, so a lookup is one hash, a binary search and a short linear scan.
+/// The table refers to the keys and specs of the map it was built from and is invalidated when the map changes.
+class CompiledCommandTable {
  public:
-  virtual ~ExchangeState();
+  struct Argument {
+    std::string_view name;
+    const ArgumentSpec* spec;
+  };
+  struct Command {
+    size_t hash;
+    std::string_view qualifier;
+    const CommandSpec* spec;
+    // range in the argument table
+    size_t first_arg;
+    size_t n_args;
+  };
+
+ private:
+  std::pmr::vector<Command> commands_;
+  std::pmr::vector<Argument> args_;
+
+ public:
+  explicit CompiledCommandTable(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : commands_(resource),
+        args_(resource) {}
+  void Build(const CommandMap& command_map) {
+    commands_.clear();
+    args_.clear();
+    commands_.reserve(command_map.size());
+    for (auto& item : command_map) {
+      Command command{std::hash<std::string_view>{}(item.first), item.first, &item.second, args_.size(), item.second.arg_map.size()};
+      // in the order of the slots
+      args_.resize(args_.size() + command.n_args);
+      for (auto& arg : item.second.arg_map) {
+        args_[command.first_arg + arg.second.slot] = {arg.first, &arg.second};
+      }
+      commands_.push_back(command);
+    }
+    std::sort(commands_.begin(), commands_.end(), [](const Command& a, const Command& b) { return a.hash < b.hash; });
+  }
+  void Clear() {
+    commands_.clear();
+    args_.clear();
+  }
+  [[nodiscard]] size_t size() const { return commands_.size(); }
+
+  /// \return nullptr if the qualifier is not in the table.
+  [[nodiscard]] const Command* Find(std::string_view qualifier) const {
+    auto hash = std::hash<std::string_view>{}(qualifier);
+    auto it = std::lower_bound(commands_.begin(), commands_.end(), hash, [](const Command& c, size_t h) { return c.hash < h; });
+    for (; it != commands_.end() && it->hash == hash; ++it) {
+      if (it->qualifier == qualifier) {
+        return &*it;
+      }
+    }
+    return nullptr;
+  }
+  [[nodiscard]] const Argument* ArgumentsBegin(const Command& command) const { return args_.data() + command.first_arg; }
+  [[nodiscard]] const Argument* ArgumentsEnd(const Command& command) const { return args_.data() + command.first_arg + command.n_args; }
+  /// \return nullptr if the command has no such argument.
+  [[nodiscard]] const ArgumentSpec* FindArgument(const Command& command, std::string_view name) const {
+    for (auto it = ArgumentsBegin(command); it != ArgumentsEnd(command); ++it) {
+      if (it->name == name) {
+        return it->spec;
+      }
+    }
+    return nullptr;
+  }
+};
+
+/// Commands by the dot separated segments of their qualifiers. A lookup compares one segment per level and stops at the
+/// first unknown segment, so a miss costs no more than the depth of the tree. A node can hand its whole subtree to a
+/// child LineProtocol instead of holding commands.
+class CommandTrie {
+ public:
+  struct Node;
+  /// Returns a node to the memory resource of the trie.
+  struct NodeDeleter {
+    std::pmr::memory_resource* resource;
+    void operator()(Node* node) const;
+  };
+  using NodePtr = std::unique_ptr<Node, NodeDeleter>;
+  struct Node {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+    explicit Node(const allocator_type& alloc) : children(alloc) {}
+    // sorted by the segment
+    std::pmr::vector<std::pair<std::pmr::string, NodePtr>> children;
+    // key of the command in the CommandMap
+    std::string_view qualifier{};
+    const CommandSpec* spec{nullptr};
+    LineProtocol* delegate{nullptr};
+  };
+  struct Match {
+    const CommandSpec* spec{nullptr};
+    // the qualifier belongs to the namespace of a child, which receives the line without its first prefix_len bytes
+    LineProtocol* delegate{nullptr};
+    size_t prefix_len{0};
+  };
+
+ private:
+  std::pmr::memory_resource* resource_;
+  Node root_;
+
+  NodePtr MakeNode() {
+    std::pmr::polymorphic_allocator<Node> alloc(resource_);
+    auto* node = alloc.allocate(1);
+    alloc.construct(node);
+    return NodePtr(node, NodeDeleter{resource_});
+  }
+  static auto LowerBound(const Node& node, std::string_view segment) {
+    return std::lower_bound(node.children.begin(), node.children.end(), segment,
+                            [](const auto& child, std::string_view s) { return std::string_view(child.first) < s; });
+  }
+  static Node* Child(const Node& node, std::string_view segment) {
+    auto it = LowerBound(node, segment);
+    return it != node.children.end() && it->first == segment ? it->second.get() : nullptr;
+  }
+  [[nodiscard]] static bool IsEmpty(const Node& node) { return node.children.empty() && !node.spec && !node.delegate; }
+
+  template <typename F>
+  static void VisitCommands(const Node& node, F& each) {
+    if (node.spec) {
+      each(node.qualifier);
+    }
+    for (auto& child : node.children) {
+      VisitCommands(*child.second, each);
+    }
+  }
+  template <typename F>
+  static bool EraseIn(Node& node, std::string_view rest, bool subtree, F& each) {
+    auto dot = rest.find('.');
+    auto it = LowerBound(node, rest.substr(0, dot));
+    if (it == node.children.end() || it->first != rest.substr(0, dot)) {
+      return false;
+    }
+    auto& child = *it->second;
+    bool erased = false;
+    if (dot != std::string_view::npos) {
+      erased = EraseIn(child, rest.substr(dot + 1), subtree, each);
+    } else if (subtree) {
+      VisitCommands(child, each);
+      child.children.clear();
+      child.spec = nullptr;
+      child.delegate = nullptr;
+      erased = true;
+    } else if (child.spec) {
+      each(child.qualifier);
+      child.spec = nullptr;
+      erased = true;
+    }
+    if (IsEmpty(child)) {
+      node.children.erase(it);
+    }
+    return erased;
+  }
+
+ public:
+  explicit CommandTrie(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : resource_(resource), root_(resource) {}
+
+  /// Add the path of the qualifier.
+  /// \return the node of the qualifier, nullptr if the path crosses the namespace of a child.
+  Node* Insert(std::string_view qualifier) {
+    Node* node = &root_;
+    size_t pos = 0;
+    while (true) {
+      if (node->delegate) {
+        return nullptr;
+      }
+      auto dot = qualifier.find('.', pos);
+      auto segment = qualifier.substr(pos, dot == std::string_view::npos ? dot : dot - pos);
+      auto it = LowerBound(*node, segment);
+      if (it == node->children.end() || it->first != segment) {
+        it = node->children.emplace(it, std::pmr::string(segment, resource_), MakeNode());
+      }
+      node = it->second.get();
+      if (dot == std::string_view::npos) {
+        return node;
+      }
+      pos = dot + 1;
+    }
+  }
+
+  /// \return the node of the qualifier, nullptr if its path does not exist. Mounts are not followed.
+  [[nodiscard]] const Node* FindNode(std::string_view qualifier) const {
+    const Node* node = &root_;
+    size_t pos = 0;
+    while (node) {
+      auto dot = qualifier.find('.', pos);
+      node = Child(*node, qualifier.substr(pos, dot == std::string_view::npos ? dot : dot - pos));
+      if (dot == std::string_view::npos) {
+        break;
+      }
+      pos = dot + 1;
+    }
+    return node;
+  }
+
+  [[nodiscard]] Match Find(std::string_view qualifier) const {
+    const Node* node = &root_;
+    size_t pos = 0;
+    while (true) {
+      auto dot = qualifier.find('.', pos);
+      node = Child(*node, qualifier.substr(pos, dot == std::string_view::npos ? dot : dot - pos));
+      if (!node) {
+        return {};
+      }
+      if (dot == std::string_view::npos) {
+        return {node->spec, nullptr, 0};
+      }
+      if (node->delegate) {
+        return {nullptr, node->delegate, dot + 1};
+      }
+      pos = dot + 1;
+    }
+  }
+
+  /// Remove one command, or with subtree the node of the prefix and everything below it, and prune the empty nodes.
+  /// \param each called with the qualifier of every removed command.
+  /// \return false if nothing was removed.
+  template <typename F>
+  bool Erase(std::string_view qualifier, bool subtree, F&& each) {
+    return EraseIn(root_, qualifier, subtree, each);
+  }
+};
+inline void CommandTrie::NodeDeleter::operator()(Node* node) const {
+  std::destroy_at(node);
+  std::pmr::polymorphic_allocator<Node>(resource).deallocate(node, 1);
+}
+
+/// What happens when the input does not fit in the buffer of LineProtocol.
+enum class BufferOverflowPolicy {
+  /// The buffer grows without bound. buf_reserve is only the initial capacity.
+  kGrow,
+  /// The buffer has a fixed capacity of buf_reserve. Feed stores what fits and returns the number of bytes accepted so
+  /// the caller can retry after Process. A line that alone fills the buffer can never complete and is discarded.
+  kReject,
+  /// The buffer has a fixed capacity of buf_reserve. The line that does not fit is discarded with the input up to the
+  /// next delimiter, so a truncated command is never executed.
+  kDiscardLine,
+};
+
+/// Bounds of the work of LineProtocol on malformed input, see LineProtocol::SetProcessLimits. 0 is no limit.
+struct ProcessLimits {
+  /// Longer lines are discarded and counted by GetOverflowCount. A partial line is discarded with the rest of its
+  /// input as soon as it exceeds the limit, so a sender that never sends the delimiter cannot grow the buffer.
+  size_t max_line_length{0};
+  /// Lines with more tokens, or frames with more arguments, fail with "Too many tokens". FLP_MAX_TOKENS is the bound
+  /// when it is lower.
+  size_t max_tokens{0};
+  /// Bytes searched for a delimiter by one call of Process, ProcessBatch or ProcessBuffer. The search resumes there on
+  /// the next call, and ProcessBuffer copies the input it did not search into the buffer.
+  size_t max_scan_bytes{0};
+};
+
+/// Result of LineProtocol::ProcessBatch.
+struct ProcessSummary {
+  /// Number of commands dispatched, including the failed ones.
+  size_t processed{0};
+  size_t failed{0};
+  /// Message of the first failure. Empty if all commands succeeded.
+  std::string first_error{};
+  /// Number of bytes taken from the input of ProcessBuffer. It is less than the length only with
+  /// BufferOverflowPolicy::kReject, when the copied part does not fit; pass the rest again later.
+  size_t taken{0};
+};
+
+/// Format a state value for the output without allocation. Integers are written in decimal and floating points like
+/// std::ostream does by default, or with n_decimal fixed decimals if n_decimal >= 0.
+/// \return number of characters written, 0 if the buffer is too small.
+template <typename T>
+size_t FormatValue(char* first, char* last, T value, int n_decimal = -1) {
+  if constexpr (std::is_enum_v<T>) {
+    return FormatValue(first, last, static_cast<std::underlying_type_t<T>>(value), n_decimal);
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return FormatValue(first, last, static_cast<int>(value), n_decimal);
+  } else if constexpr (std::is_integral_v<T>) {
+    auto result = std::to_chars(first, last, value);
+    return result.ec == std::errc() ? result.ptr - first : 0;
+  } else {
+#if FLP_HAS_FLOAT_TO_CHARS
+    auto result = n_decimal >= 0 ? std::to_chars(first, last, value, std::chars_format::fixed, n_decimal)
+                                 : std::to_chars(first, last, value, std::chars_format::general, 6);
+    return result.ec == std::errc() ? result.ptr - first : 0;
+#else
+    int n = n_decimal >= 0 ? snprintf(first, last - first, "%.*f", n_decimal, static_cast<double>(value))
+                           : snprintf(first, last - first, "%g", static_cast<double>(value));
+    return n >= 0 && n < last - first ? n : 0;
+#endif
+  }
+}
+
+/// Read a little-endian value from the front of the data.
+template <typename T>
+T ReadLE(const char* data) {
+  std::conditional_t<sizeof(T) == 8, uint64_t, std::conditional_t<sizeof(T) == 4, uint32_t, std::conditional_t<sizeof(T) == 2, uint16_t, uint8_t>>> bits = 0;
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    bits |= static_cast<decltype(bits)>(static_cast<uint8_t>(data[i])) << (8 * i);
+  }
+  T value;
+  std::memcpy(&value, &bits, sizeof(T));
+  return value;
+}
+
+/// Read a tagged value from the front of the frame and remove it.
+/// \return false if the tag is unknown or the frame ends early.
+inline bool ReadBinaryValue(std::string_view& frame, NumericValue& out) {
+  if (frame.empty()) {
+    return false;
+  }
+  auto type = static_cast<BinaryType>(frame[0]);
+  static constexpr size_t kSizes[] = {1, 4, 4, 8, 4, 8};
+  if (static_cast<uint8_t>(type) >= sizeof(kSizes) / sizeof(kSizes[0]) || frame.size() < 1 + kSizes[static_cast<uint8_t>(type)]) {
+    return false;
+  }
+  const char* data = frame.data() + 1;
+  out.is_int = type != BinaryType::kFloat && type != BinaryType::kDouble;
+  out.type = type;
+  switch (type) {
+    case BinaryType::kBool: out.int_val = ReadLE<uint8_t>(data); break;
+    case BinaryType::kInt32: out.int_val = ReadLE<int32_t>(data); break;
+    case BinaryType::kUint32: out.int_val = ReadLE<uint32_t>(data); break;
+    case BinaryType::kInt64: out.int_val = ReadLE<int64_t>(data); break;
+    case BinaryType::kFloat: out.float_val = ReadLE<float>(data); break;
+    case BinaryType::kDouble: out.float_val = ReadLE<double>(data); break;
+  }
+  if (out.is_int) {
+    out.float_val = static_cast<double>(out.int_val);
+  }
+  frame.remove_prefix(1 + kSizes[static_cast<uint8_t>(type)]);
+  return true;
+}
+
+/// Decode a COBS frame in place. The frame does not include the terminating 0x00.
+/// \return the decoded size, or SIZE_MAX if the frame is malformed.
+inline size_t CobsDecode(char* data, size_t len) {
+  size_t read = 0;
+  size_t write = 0;
+  while (read < len) {
+    auto code = static_cast<uint8_t>(data[read++]);
+    if (code == 0 || read + code - 1 > len) {
+      return SIZE_MAX;
+    }
+    for (uint8_t i = 1; i < code; ++i) {
+      data[write++] = data[read++];
+    }
+    if (code != 0xFF && read < len) {
+      data[write++] = 0;
+    }
+  }
+  return write;
+}
+
+class BufferedOutput;
+
+/// Collects the output in a fixed buffer and passes it to the sink when the buffer is full or flushed, so a response of
+/// any length is written without allocation. A binary frame is COBS encoded on the fly and terminated by 0x00.
+class ResponseWriter {
+  char* buf_;
+  size_t capacity_;
+  size_t size_{0};
+  const OutputSink& sink_;
+  // counts the bytes passed to the sink, can be nullptr
+  size_t* bytes_out_;
+  // the stage behind the sink, told where each response ends, can be nullptr
+  BufferedOutput* staged_;
+  // COBS stage of the binary frames. The current block is collected here, block_[0] is its code.
+  bool cobs_;
+  uint8_t block_[255];
+  size_t block_size_{1};
+
+  void RawWrite(const char* data, size_t len) {
+    if (size_ + len > capacity_) {
+      Flush();
+      if (len > capacity_) {
+        // too large for the buffer anyway
+        Output(data, len);
+        return;
+      }
+    }
+    std::memcpy(buf_ + size_, data, len);
+    size_ += len;
+  }
+  void Output(const char* data, size_t len) {
+    if (bytes_out_) {
+      *bytes_out_ += len;
+    }
+    sink_(data, len);
+  }
+  void RawWrite(char c) {
+    if (size_ == capacity_) {
+      Flush();
+    }
+    buf_[size_++] = c;
+  }
+  void FinishBlock() {
+    block_[0] = static_cast<uint8_t>(block_size_);
+    RawWrite(reinterpret_cast<const char*>(block_), block_size_);
+    block_size_ = 1;
+  }
+  void CobsPut(char c) {
+    if (c == 0) {
+      FinishBlock();
+      return;
+    }
+    block_[block_size_++] = static_cast<uint8_t>(c);
+    if (block_size_ == sizeof(block_)) {
+      FinishBlock();
+    }
+  }
+
+ public:
+  ResponseWriter(char* buf, size_t capacity, const OutputSink& sink, bool binary = false, size_t* bytes_out = nullptr, BufferedOutput* staged = nullptr) : buf_(buf), capacity_(capacity), sink_(sink), bytes_out_(bytes_out), staged_(staged), cobs_(binary) {}
+  ResponseWriter(const ResponseWriter&) = delete;
+  ResponseWriter(ResponseWriter&& other) noexcept : buf_(other.buf_), capacity_(other.capacity_), size_(other.size_), sink_(other.sink_), bytes_out_(other.bytes_out_), staged_(other.staged_), cobs_(other.cobs_), block_size_(other.block_size_) {
+    std::memcpy(block_, other.block_, block_size_);
+    other.size_ = 0;
+    other.block_size_ = 1;
+  }
+  ~ResponseWriter() { Flush(); }
+
+  [[nodiscard]] bool IsBinary() const { return cobs_; }
+  void Write(std::string_view str) {
+    if (cobs_) {
+      for (char c : str) {
+        CobsPut(c);
+      }
+    } else {
+      RawWrite(str.data(), str.size());
+    }
+  }
+  void Write(char c) {
+    if (cobs_) {
+      CobsPut(c);
+    } else {
+      RawWrite(c);
+    }
+  }
+  /// Write the value as text.
+  template <typename T>
+  void WriteValue(T value, int n_decimal = -1) {
+    char value_buf[64];
+    auto len = FormatValue(value_buf, value_buf + sizeof(value_buf), value, n_decimal);
+    if (len == 0 && n_decimal >= 0) {
+      // too many digits in fixed format
+      len = FormatValue(value_buf, value_buf + sizeof(value_buf), value);
+    }
+    Write(std::string_view(value_buf, len));
+  }
+  /// Write the raw little-endian bytes of the value.
+  template <typename T>
+  void WriteLE(T value) {
+    std::conditional_t<sizeof(T) == 8, uint64_t, std::conditional_t<sizeof(T) == 4, uint32_t, std::conditional_t<sizeof(T) == 2, uint16_t, uint8_t>>> bits;
+    static_assert(sizeof(bits) == sizeof(T), "unsupported size");
+    std::memcpy(&bits, &value, sizeof(T));
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      Write(static_cast<char>((bits >> (8 * i)) & 0xFF));
+    }
+  }
+  /// Write the type tag and the little-endian bytes of the value.
+  template <typename T>
+  void WriteBinaryValue(T value) {
+    constexpr auto type = BinaryTypeOf<T>();
+    Write(static_cast<char>(type));
+    if constexpr (type == BinaryType::kBool) {
+      WriteLE(static_cast<uint8_t>(value));
+    } else if constexpr (type == BinaryType::kInt32) {
+      WriteLE(static_cast<int32_t>(value));
+    } else if constexpr (type == BinaryType::kUint32) {
+      WriteLE(static_cast<uint32_t>(value));
+    } else if constexpr (type == BinaryType::kInt64) {
+      WriteLE(static_cast<int64_t>(value));
+    } else if constexpr (type == BinaryType::kFloat) {
+      WriteLE(static_cast<float>(value));
+    } else {
+      WriteLE(static_cast<double>(value));
+    }
+  }
+  /// Terminate the response: '\n' for text, 0x00 for a binary frame.
+  void End();
+  void Flush() {
+    if (size_ > 0 && sink_) {
+      Output(buf_, size_);
+    }
+    size_ = 0;
+  }
+};
+
+/// When BufferedOutput hands the collected output to the writer.
+enum class OutputFlushPolicy {
+  /// Once the collected output reaches the threshold, and on FlushOutput or Tick.
+  kThreshold,
+  /// Only on FlushOutput or Tick.
+  kTick,
+};
+
+struct BufferedOutputConfig {
+  /// size of each of the two buffers
+  size_t capacity{512};
+  OutputFlushPolicy policy{OutputFlushPolicy::kThreshold};
+  size_t threshold{256};
+  /// The writer only starts the transfer of the bytes it takes, and they stay valid until CompleteOutput is called.
+  /// Otherwise the bytes are done with when the writer returns.
+  bool asynchronous{false};
+};
+
+/// Double buffered stage in front of a non-blocking writer. The output is collected in the back buffer while the front
+/// buffer is written, and the two are swapped when the front one is done. Only whole responses are handed over, unless
+/// a response fills the back buffer by itself; it then goes out in pieces as the writer takes them. A response that
+/// does not fit while both buffers are busy is dropped as a whole and counted. If its first pieces went out already,
+/// the rest is dropped and only its terminator is written, so the host sees one damaged response and resynchronizes.
+class BufferedOutput {
+  std::vector<char> front_{};
+  std::vector<char> back_{};
+  size_t front_size_{0};
+  size_t front_sent_{0};
+  size_t back_size_{0};
+  // taken by an asynchronous writer and not completed yet
+  size_t in_flight_{0};
+  // bytes of the response being written, see EndResponse
+  size_t open_{0};
+  // the rest of the response being written is dropped
+  bool dropping_{false};
+  // the dropped response went out in part
+  bool truncating_{false};
+  size_t dropped_{0};
+  size_t truncated_{0};
+  OutputWriter writer_{};
+  BufferedOutputConfig config_{};
+
+  [[nodiscard]] bool FrontDone() const { return front_sent_ == front_size_ && in_flight_ == 0; }
+  /// \return the bytes at the end of the back buffer that stay there on a swap: the start of an unfinished response,
+  /// so it can still be dropped as a whole. Once a response went out in part, its rest is not held.
+  [[nodiscard]] size_t Held() const { return open_ <= back_size_ ? open_ : 0; }
+  /// Hand the back buffer to the writer, except its last keep bytes.
+  void Swap(size_t keep) {
+    std::swap(front_, back_);
+    front_size_ = back_size_ - keep;
+    front_sent_ = 0;
+    std::memcpy(back_.data(), front_.data() + front_size_, keep);
+    back_size_ = keep;
+    Send();
+  }
+  void DropResponse(size_t rest) {
+    if (open_ <= back_size_) {
+      back_size_ -= open_;
+      dropped_ += open_;
+    } else {
+      // the response went out in part, the back buffer holds nothing but its continuation
+      dropped_ += back_size_;
+      back_size_ = 0;
+      truncating_ = true;
+    }
+    dropped_ += rest;
+    dropping_ = true;
+  }
+  void Send() {
+    auto taken = writer_(front_.data() + front_sent_, front_size_ - front_sent_);
+    if (config_.asynchronous) {
+      in_flight_ = taken;
+    } else {
+      front_sent_ += taken;
+    }
+  }
+
+ public:
+  BufferedOutput() = default;
+  BufferedOutput(OutputWriter writer, const BufferedOutputConfig& config)
+      : front_(config.capacity), back_(config.capacity), writer_(std::move(writer)), config_(config) {}
+
+  /// Collect a piece of the current response. It is the sink of the LineProtocol.
+  void Write(const char* data, size_t len) {
+    if (dropping_) {
+      dropped_ += len;
+      return;
+    }
+    while (true) {
+      auto n = std::min(len, back_.size() - back_size_);
+      std::memcpy(back_.data() + back_size_, data, n);
+      back_size_ += n;
+      open_ += n;
+      data += n;
+      len -= n;
+      if (len == 0) {
+        return;
+      }
+      // the back buffer is full: hand over the finished responses, or the piece of a response that fills it alone
+      Flush();
+      if (back_size_ == back_.size() && FrontDone()) {
+        Swap(0);
+      }
+      if (back_size_ == back_.size()) {
+        DropResponse(len);
+        return;
+      }
+    }
+  }
+  /// The response written since the previous call is complete; terminator is its last byte.
+  void EndResponse(char terminator) {
+    if (truncating_) {
+      // the host receives the start of the response, end it so the next one is framed
+      back_[back_size_++] = terminator;
+      --dropped_;
+      ++truncated_;
+    }
+    open_ = 0;
+    dropping_ = false;
+    truncating_ = false;
+    if (config_.policy == OutputFlushPolicy::kThreshold && back_size_ >= config_.threshold) {
+      Flush();
+    }
+  }
+  /// Continue writing the front buffer, or swap in the back buffer if the front one is done. The start of an unfinished
+  /// response stays in the back buffer.
+  /// \return whether all the output has been written.
+  bool Flush() {
+    if (front_sent_ < front_size_ && in_flight_ == 0) {
+      Send();
+    }
+    if (FrontDone() && back_size_ > Held()) {
+      Swap(Held());
+    }
+    return FrontDone() && back_size_ == 0;
+  }
+  /// The asynchronous transfer started by the writer has finished. The remaining output is handed over.
+  void Complete() {
+    front_sent_ += in_flight_;
+    in_flight_ = 0;
+    Flush();
+  }
+  /// \return number of bytes waiting to be written.
+  [[nodiscard]] size_t Pending() const { return front_size_ - front_sent_ + back_size_; }
+  /// \return whether the back buffer cannot take another full response.
+  [[nodiscard]] bool IsBackpressured() const { return back_.size() - back_size_ < FLP_RESPONSE_BUFFER_SIZE; }
+  [[nodiscard]] bool IsActive() const { return static_cast<bool>(writer_); }
+  [[nodiscard]] size_t GetDroppedBytes() const { return dropped_; }
+  /// \return number of responses that went out in part, see the class description.
+  [[nodiscard]] size_t GetTruncatedCount() const { return truncated_; }
+};
+
+inline void ResponseWriter::End() {
+  char terminator = cobs_ ? '\0' : '\n';
+  if (cobs_) {
+    FinishBlock();
+  }
+  RawWrite(terminator);
+  Flush();
+  if (staged_) {
+    staged_->EndResponse(terminator);
+  }
+}
+
+/// Direction of a CaptureLog record.
+enum class CaptureKind : uint8_t {
+  /// bytes given to Feed, ProcessBuffer or QueueInput
+  kInput = 0,
+  /// bytes written to the output sink
+  kOutput = 1,
+};
+struct CaptureRecord {
+  CaptureKind kind;
+  int64_t timestamp;
+  std::string_view data;
+};
+
+/// Ring log of the input and the output of a LineProtocol, see LineProtocol::SetCapture. A record is the kind (u8),
+/// the time since the previous record and the length, both varints, then the bytes, so a short line costs 3 bytes
+/// more than its text. When the ring is full the oldest records are dropped.
+/// The capture format of Save, read by ForEachCaptureRecord and the flp_replay tool, is "FLPC", the version (u8), the
+/// timestamp of the first record (i64 LE), then the records. The time field of the first record is not used.
+class CaptureLog {
+ public:
+  static constexpr uint8_t kVersion = 1;
+  static constexpr size_t kHeaderSize = 13;
+
+ private:
+  std::unique_ptr<char[]> owned_{};
+  char* buf_;
+  size_t capacity_;
+  // the oldest record
+  size_t head_{0};
+  size_t size_{0};
+  size_t n_records_{0};
+  size_t n_dropped_{0};
+  int64_t first_timestamp_{0};
+  int64_t last_timestamp_{0};
+
+  void Put(uint8_t c) {
+    buf_[(head_ + size_++) % capacity_] = static_cast<char>(c);
+  }
+  void PutVarint(uint64_t v) {
+    for (; v >= 0x80; v >>= 7) {
+      Put(static_cast<uint8_t>(v | 0x80));
+    }
+    Put(static_cast<uint8_t>(v));
+  }
+  [[nodiscard]] uint8_t At(size_t pos) const { return static_cast<uint8_t>(buf_[(head_ + pos) % capacity_]); }
+  uint64_t VarintAt(size_t& pos) const {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+      auto c = At(pos++);
+      v |= static_cast<uint64_t>(c & 0x7f) << shift;
+      if (!(c & 0x80)) {
+        return v;
+      }
+    }
+  }
+  static size_t VarintSize(uint64_t v) {
+    size_t n = 1;
+    for (; v >= 0x80; v >>= 7) {
+      ++n;
+    }
+    return n;
+  }
+  void DropOldest() {
+    size_t pos = 1;
+    VarintAt(pos);
+    pos += VarintAt(pos);
+    head_ = (head_ + pos) % capacity_;
+    size_ -= pos;
+    if (--n_records_ > 0) {
+      // the next record becomes the first one
+      pos = 1;
+      first_timestamp_ += ZigzagDecode(VarintAt(pos));
+    }
+    ++n_dropped_;
+  }
+
+ public:
+  static uint64_t ZigzagEncode(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+  static int64_t ZigzagDecode(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+  explicit CaptureLog(size_t capacity) : owned_(new char[capacity]), buf_(owned_.get()), capacity_(capacity) {}
+  /// A log in the storage of the caller, e.g. a static buffer.
+  CaptureLog(char* buf, size_t capacity) : buf_(buf), capacity_(capacity) {}
+
+  /// Append a record, dropping the oldest ones to make room. A record larger than the ring is dropped.
+  void Record(CaptureKind kind, int64_t timestamp, const char* data, size_t len) {
+    auto delta = ZigzagEncode(n_records_ ? timestamp - last_timestamp_ : 0);
+    size_t need = 1 + VarintSize(delta) + VarintSize(len) + len;
+    if (need > capacity_) {
+      ++n_dropped_;
+      return;
+    }
+    while (capacity_ - size_ < need) {
+      DropOldest();
+    }
+    if (!n_records_) {
+      first_timestamp_ = timestamp;
+      delta = 0;
+    }
+    Put(static_cast<uint8_t>(kind));
+    PutVarint(delta);
+    PutVarint(len);
+    for (size_t i = 0; i < len; ++i) {
+      Put(static_cast<uint8_t>(data[i]));
+    }
+    last_timestamp_ = timestamp;
+    ++n_records_;
+  }
+  void Clear() {
+    head_ = size_ = n_records_ = 0;
+  }
+  /// \return the bytes of the records in the ring.
+  [[nodiscard]] size_t size() const { return size_; }
+  [[nodiscard]] size_t capacity() const { return capacity_; }
+  [[nodiscard]] size_t GetRecordCount() const { return n_records_; }
+  /// \return number of records dropped from a full ring or too large for it.
+  [[nodiscard]] size_t GetDroppedCount() const { return n_dropped_; }
+
+  /// Append the records in the capture format to out.
+  void Save(std::string& out) const {
+    out.append("FLPC");
+    out.push_back(static_cast<char>(kVersion));
+    auto bits = static_cast<uint64_t>(first_timestamp_);
+    for (size_t i = 0; i < 8; ++i) {
+      out.push_back(static_cast<char>((bits >> (8 * i)) & 0xFF));
+    }
+    size_t first = std::min(size_, capacity_ - head_);
+    out.append(buf_ + head_, first);
+    out.append(buf_, size_ - first);
+  }
+};
+
+/// Call f(const CaptureRecord&) for each record of a capture written by CaptureLog::Save.
+/// \return false if the capture is malformed or truncated; the records before the damage have been passed to f.
+template <typename F>
+bool ForEachCaptureRecord(std::string_view capture, F&& f) {
+  if (capture.size() < CaptureLog::kHeaderSize || capture.substr(0, 4) != "FLPC" ||
+      static_cast<uint8_t>(capture[4]) != CaptureLog::kVersion) {
+    return false;
+  }
+  auto timestamp = ReadLE<int64_t>(capture.data() + 5);
+  size_t pos = CaptureLog::kHeaderSize;
+  auto varint = [&](uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && pos < capture.size(); shift += 7) {
+      auto c = static_cast<uint8_t>(capture[pos++]);
+      v |= static_cast<uint64_t>(c & 0x7f) << shift;
+      if (!(c & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  for (bool first = true; pos < capture.size(); first = false) {
+    auto kind = static_cast<uint8_t>(capture[pos++]);
+    uint64_t delta, len;
+    if (kind > static_cast<uint8_t>(CaptureKind::kOutput) || !varint(delta) || !varint(len) || len > capture.size() - pos) {
+      return false;
+    }
+    if (!first) {
+      timestamp += CaptureLog::ZigzagDecode(delta);
+    }
+    f(CaptureRecord{static_cast<CaptureKind>(kind), timestamp, capture.substr(pos, len)});
+    pos += len;
+  }
+  return true;
+}
+
+#if FLP_ENABLE_CONCURRENCY
+inline size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+/// Lock-free byte queue between one producer and one consumer. The capacity is rounded up to a power of two.
+class SpscByteQueue {
+  std::unique_ptr<char[]> buf_;
+  size_t mask_;
+  // written by the producer
+  alignas(64) std::atomic<size_t> head_{0};
+  // written by the consumer
+  alignas(64) std::atomic<size_t> tail_{0};
+
+ public:
+  explicit SpscByteQueue(size_t capacity) : buf_(new char[RoundUpToPowerOfTwo(capacity)]), mask_(RoundUpToPowerOfTwo(capacity) - 1) {}
+
+  /// Producer side.
+  /// \return number of bytes taken, less than len if the queue is full.
+  size_t Push(const char* data, size_t len) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto tail = tail_.load(std::memory_order_acquire);
+    len = std::min(len, mask_ + 1 - (head - tail));
+    size_t first = std::min(len, mask_ + 1 - (head & mask_));
+    std::memcpy(buf_.get() + (head & mask_), data, first);
+    std::memcpy(buf_.get(), data + first, len - first);
+    head_.store(head + len, std::memory_order_release);
+    return len;
+  }
+  /// Consumer side. Pass the queued bytes to consume(const char*, size_t) in at most two contiguous pieces.
+  /// \return number of bytes consumed.
+  template <typename F>
+  size_t Drain(F&& consume) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+    size_t len = head - tail;
+    size_t first = std::min(len, mask_ + 1 - (tail & mask_));
+    if (first > 0) {
+      consume(buf_.get() + (tail & mask_), first);
+    }
+    if (len > first) {
+      consume(buf_.get(), len - first);
+    }
+    tail_.store(head, std::memory_order_release);
+    return len;
+  }
+};
+
+/// Bounded lock-free queue of output bytes for many producers and one consumer. A message reserves consecutive cells in
+/// one step, so the messages of different producers do not interleave. The number of cells is rounded up to a power
+/// of two.
+class MpscOutputQueue {
+  static_assert(FLP_OUTPUT_CELL_SIZE > 0 && FLP_OUTPUT_CELL_SIZE <= 255, "the length of a cell is stored in a byte");
+  struct Cell {
+    // the position the cell is free for, or that position + 1 once it holds data
+    std::atomic<size_t> seq;
+    uint8_t len;
+    char data[FLP_OUTPUT_CELL_SIZE];
+  };
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> enqueue_pos_{0};
+  std::atomic<size_t> dropped_{0};
+  // consumer only
+  alignas(64) size_t dequeue_pos_{0};
+
+ public:
+  explicit MpscOutputQueue(size_t n_cells) : cells_(new Cell[RoundUpToPowerOfTwo(n_cells)]), mask_(RoundUpToPowerOfTwo(n_cells) - 1) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /// Producer side.
+  /// \return false if the queue does not have room for the message, which is dropped then.
+  bool Push(const char* data, size_t len) {
+    size_t n_cells = (len + FLP_OUTPUT_CELL_SIZE - 1) / FLP_OUTPUT_CELL_SIZE;
+    if (n_cells == 0) {
+      return true;
+    }
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      if (n_cells > mask_ + 1) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      // the cells are consumed in order, so the others are free if the last one is
+      size_t last = pos + n_cells - 1;
+      auto diff = static_cast<std::ptrdiff_t>(cells_[last & mask_].seq.load(std::memory_order_acquire) - last);
+      if (diff == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + n_cells, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    for (size_t i = 0; i < n_cells; ++i) {
+      auto& cell = cells_[(pos + i) & mask_];
+      size_t n = std::min<size_t>(len, FLP_OUTPUT_CELL_SIZE);
+      std::memcpy(cell.data, data, n);
+      cell.len = static_cast<uint8_t>(n);
+      data += n;
+      len -= n;
+      cell.seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return true;
+  }
+  /// Consumer side. Pass the published bytes to consume(const char*, size_t) in order. It stops at a cell whose
+  /// producer is still writing.
+  /// \return number of bytes consumed.
+  template <typename F>
+  size_t Drain(F&& consume) {
+    size_t total = 0;
+    while (true) {
+      auto& cell = cells_[dequeue_pos_ & mask_];
+      if (cell.seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+        return total;
+      }
+      consume(cell.data, cell.len);
+      total += cell.len;
+      cell.seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+      ++dequeue_pos_;
+    }
+  }
+  /// \return number of messages dropped because the queue was full.
+  [[nodiscard]] size_t GetDroppedCount() const { return dropped_.load(std::memory_order_relaxed); }
+};
+#endif
+
+/// How the ExchangeStates are reported when they are set.
+enum class ReportMode {
+  /// Every Set is reported right away.
+  kImmediate,
+  /// Set marks the state dirty. The dirty states are reported by FlushStates, or by Tick at most once per the report
+  /// interval, with their latest values.
+  kCoalesced,
+};
+
+// Classes
+
+/// Counts the changes of the ExchangeStates, see @flp.state.since. It wraps around after 2^32 changes.
+#if FLP_ENABLE_CONCURRENCY
+using StateSequence = std::atomic<uint32_t>;
+#else
+using StateSequence = uint32_t;
+#endif
+/// One bit per session of a CommandRegistry, see @flp.subscribe.
+#if FLP_ENABLE_CONCURRENCY
+using SubscriberMask = std::atomic<uint32_t>;
+#else
+using SubscriberMask = uint32_t;
+#endif
+
+/// Selects the constructor of ExchangeState that leaves the registration to ExchangeState::Register or
+/// LineProtocol::RegisterExchangeStates.
+struct DeferRegistration {};
+
+/// Type independent part of ExchangeState, used by the report scheduler of LineProtocol.
+class ExchangeStateBase {
+  friend class LineProtocol;
+  friend class CommandRegistry;
+  // waiting in the coalesced report list
+  bool dirty_{false};
+  // id in the binary framing, see BinarySchema
+  uint16_t binary_id_{0};
+  // sequence number of the last change
+  StateSequence seq_{0};
+  // the sessions that receive the reports
+  SubscriberMask subscribers_{0};
+
+ public:
+  virtual ~ExchangeStateBase() = default;
+  /// \return the sequence number of the last change, or of the registration if the value has not changed since.
+  [[nodiscard]] uint32_t GetSequence() const { return seq_; }
+  virtual void ReportState() = 0;
+  /// \param suppress_unchanged whether a value equal to the last report is skipped even if the deadband is disabled.
+  /// \return whether the value differs enough from the last report to be sent.
+  [[nodiscard]] virtual bool IsReportDue(bool suppress_unchanged) const = 0;
+};
+
+/// Represent the states that is managed by FLP. It can be used as the argument and the setter will be automatically adapted.
+/// When the setter is invoked, the state will be reported to the ostream.
+/// \tparam T
+template <typename T>
+class ExchangeState : public ExchangeStateBase {
+  LineProtocol& flp_;
+
+ public:
+  virtual ~ExchangeState();
+
+ private:
+  std::string name_;
+#if FLP_ENABLE_CONCURRENCY
+  // a lock-free type is stored atomically, so the value can be read while another thread sets it
+  std::conditional_t<std::atomic<T>::is_always_lock_free, std::atomic<T>, T> state_{};
+#else
+  T state_{};
+#endif
+  T last_reported_{};
+  bool has_reported_{false};
+  bool registered_{false};
+
+  ValueGetter getter_ = [this]() { return NumericValue::Of(Get()).template As<float>(); };
+  ValueSetter setter_ = [this](float v) { Set(NumericValue::Of(v).template As<T>()); };
+
+ public:
+  bool report_state{true};
+  // affect the output precision when T is float
+  int n_decimal{-1};
+  /// A new value is reported only if it moved more than deadband since the last report; 0 skips the unchanged values.
+  /// Negative disables the filter, but the coalesced reporting still skips the unchanged values.
+  double deadband{-1};
+
+  explicit ExchangeState(LineProtocol& flp, const std::string& name);
+  ExchangeState(LineProtocol& flp, const std::string& name, DeferRegistration) : flp_(flp), name_(name) {}
+  /// Register a state constructed with DeferRegistration. Nothing is done if it is registered already.
+  bool Register();
+  [[nodiscard]] bool IsRegistered() const { return registered_; }
+#if FLP_ENABLE_CONCURRENCY
+  T Get() const { return state_; }
+#else
+  const T& Get() const { return state_; }
+#endif
+  [[deprecated("use Get, which keeps the type of the state")]] [[nodiscard]] const ValueGetter& Getter() const {
+    return getter_;
+  }
+  [[deprecated("use Set, which keeps the type of the state")]] [[nodiscard]] ValueSetter& Setter() {
+    return setter_;
+  }
+  [[nodiscard]] const std::string& GetName() const { return name_; }
+  void Set(const T& other);
+  /// Write the report to every subscribed session, from the calling thread. With FLP_ENABLE_CONCURRENCY, a session on
+  /// another thread must have an output queue (EnableOutputQueue) to receive it; without one the report would race
+  /// with the loop thread of that session, so it asserts, and the session is skipped when NDEBUG is defined.
+  void ReportState() override;
+  [[nodiscard]] bool IsReportDue(bool suppress_unchanged) const override {
+    if (!has_reported_) {
+      return true;
+    }
+    double diff = static_cast<double>(Get()) - static_cast<double>(last_reported_);
+    diff = diff < 0 ? -diff : diff;
+    if (deadband >= 0) {
+      return diff > deadband;
+    }
+    return !suppress_unchanged || diff > 0;
+  }
+  ExchangeState<T>& operator=(const T& other) {
+    Set(other);
+    return *this;
+  }
+};
+
+/// Numeric ids of the binary framing, derived from the registration. The commands are sorted by qualifier, the
+/// arguments of each command and the exchange states by name, and the index in the sorted list is the id.
+struct BinarySchema {
+  struct Command {
+    std::string_view qualifier;
+    const CommandSpec* spec;
+    std::pmr::vector<CompiledCommandTable::Argument> args;
+  };
+  explicit BinarySchema(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : commands(resource),
+        states(resource) {}
+  std::pmr::vector<Command> commands;
+  std::pmr::vector<std::pair<std::string_view, const ExchangeStateInterface*>> states;
+};
+
+// Compile-time command schema
+
+/// FNV-1a hash of a qualifier, evaluated at compile time for the static commands.
+constexpr uint32_t HashQualifier(std::string_view qualifier) {
+  uint32_t hash = 2166136261u;
+  for (char c : qualifier) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+  }
+  return hash;
+}
+
+template <typename T>
+struct exchange_state_traits {
+  static constexpr bool is_exchange_state = false;
+  using value_type = T;
+};
+template <typename T>
+struct exchange_state_traits<ExchangeState<T>> {
+  static constexpr bool is_exchange_state = true;
+  using value_type = T;
+};
+
+/// Argument of a static Command. The setter and the validator are resolved at compile time.
+/// \tparam Name argument name with static storage, e.g. `inline constexpr char kSpeed[] = "speed";`
+/// \tparam Target pointer to the variable or ExchangeState with static storage that receives the value.
+/// \tparam Validator `bool (*)(double)` or nullptr. The range of T is checked by default if Target is an ExchangeState.
+template <const char* Name, auto* Target, bool Optional = true, auto Validator = nullptr>
+struct Arg {
+  using target_type = std::remove_pointer_t<decltype(Target)>;
+  using value_type = typename exchange_state_traits<target_type>::value_type;
+  static constexpr std::string_view name{Name};
+  static constexpr bool optional = Optional;
+  static constexpr bool is_float = std::is_floating_point_v<value_type>;
+
+  // ExchangeStates are range checked by the default validator instead
+  static bool InRange(const NumericValue& v) {
+    if constexpr (std::is_integral_v<value_type> && !exchange_state_traits<target_type>::is_exchange_state) {
+      return v.int_val >= static_cast<int64_t>(std::numeric_limits<value_type>::min())
+          && (v.int_val < 0 || static_cast<uint64_t>(v.int_val) <= static_cast<uint64_t>(std::numeric_limits<value_type>::max()));
+    } else {
+      return true;
+    }
+  }
+  static bool Validate(double v) {
+    if constexpr (!std::is_same_v<decltype(Validator), std::nullptr_t>) {
+      return Validator(v);
+    } else if constexpr (exchange_state_traits<target_type>::is_exchange_state) {
+      return IsInDefaultRange<value_type>(v);
+    } else {
+      return true;
+    }
+  }
+  static void Assign(const NumericValue& v) {
+    if constexpr (exchange_state_traits<target_type>::is_exchange_state) {
+      Target->Set(v.As<value_type>());
+    } else {
+      *Target = v.As<value_type>();
+    }
+  }
+  static NumericValue Load() {
+    if constexpr (exchange_state_traits<target_type>::is_exchange_state) {
+      return NumericValue::Of(Target->Get());
+    } else {
+      return NumericValue::Of(*Target);
+    }
+  }
+};
+
+/// Command with a compile-time schema. Unlike the runtime commands, arguments that are not in the schema are rejected.
+/// \tparam Qualifier qualifier with static storage.
+/// \tparam Callback `void (*)()` invoked after the arguments are applied, or nullptr. If it throws, the arguments are
+/// restored before the exception propagates.
+/// \tparam Args list of Arg.
+template <const char* Qualifier, auto Callback, typename... Args>
+struct Command {
+  static_assert(sizeof...(Args) <= 32, "a static command takes at most 32 arguments");
+  static constexpr std::string_view qualifier{Qualifier};
+  static constexpr uint32_t hash = HashQualifier(qualifier);
+
+ private:
+  using Indices = std::index_sequence_for<Args...>;
+  static constexpr std::array<std::string_view, sizeof...(Args)> kNames{Args::name...};
+  static constexpr std::array<bool, sizeof...(Args)> kIsFloat{Args::is_float...};
+  static constexpr std::array<bool, sizeof...(Args)> kOptional{Args::optional...};
+
+  template <size_t... I>
+  static bool InRangeAt(size_t index, const NumericValue& v, std::index_sequence<I...>) {
+    bool ok = false;
+    (void)((index == I ? (ok = Args::InRange(v), true) : false) || ...);
+    return ok;
+  }
+  template <size_t... I>
+  static bool ValidateAt(size_t index, const NumericValue& v, std::index_sequence<I...>) {
+    bool ok = false;
+    (void)((index == I ? (ok = Args::Validate(v.As<double>()), true) : false) || ...);
+    return ok;
+  }
+  template <size_t... I>
+  static void AssignSupplied(const std::array<NumericValue, sizeof...(Args)>& values, uint32_t supplied, std::index_sequence<I...>) {
+    ((supplied & (1u << I) ? Args::Assign(values[I]) : void()), ...);
+  }
+  template <size_t... I>
+  static void LoadSupplied(std::array<NumericValue, sizeof...(Args)>& values, uint32_t supplied, std::index_sequence<I...>) {
+    ((supplied & (1u << I) ? void(values[I] = Args::Load()) : void()), ...);
+  }
+
+ public:
+  static bool Apply(const CommandTokens& tokens) {
+    std::array<NumericValue, sizeof...(Args)> values{};
+    uint32_t supplied = 0;
+    for (size_t i = 1; i < tokens.size(); ++i) {
+      auto token = tokens[i];
+      auto eq_pos = tokens.EqualsPos(i);
+      if (eq_pos == std::string_view::npos) {
+        FLP_THROW(InvalidArgumentError, "Invalid argument: " + std::string(token));
+      }
+      auto arg_name = token.substr(0, eq_pos);
+      auto arg_value = token.substr(eq_pos + 1);
+      if (arg_value.empty()) {
+        FLP_THROW(InvalidArgumentError, std::string(token) + " incomplete pair");
+      }
+      NumericValue value;
+      if (!ParseNumericValue(arg_value, value)) {
+        FLP_THROW(InvalidArgumentError, std::string(token) + " value is not numeric");
+      }
+
+      size_t index = 0;
+      while (index < kNames.size() && kNames[index] != arg_name) {
+        ++index;
+      }
+      if (index == kNames.size()) {
+        FLP_THROW(InvalidArgumentError, std::string(token) + " is not an argument of " + std::string(qualifier));
+      }
+      if (!kIsFloat[index] && !value.is_int) {
+        FLP_THROW(InvalidArgumentError, std::string(token) + "  should be int");
+      }
+      if (!kIsFloat[index] && !InRangeAt(index, value, Indices{})) {
+        FLP_THROW(InvalidArgumentError, std::string(token) + " is out of range");
+      }
+      if (!ValidateAt(index, value, Indices{})) {
+        FLP_THROW(ValidatorError, std::string(token) + " validation failed");
+      }
+      values[index] = value;
+      supplied |= 1u << index;
+    }
+
+    for (size_t i = 0; i < kNames.size(); ++i) {
+      if (!kOptional[i] && !(supplied & (1u << i))) {
+        FLP_THROW(InvalidArgumentError, std::string(kNames[i]) + " is required");
+      }
+    }
+
+    if constexpr (!std::is_same_v<decltype(Callback), std::nullptr_t>) {
+#ifdef __EXCEPTIONS
+      std::array<NumericValue, sizeof...(Args)> previous{};
+      LoadSupplied(previous, supplied, Indices{});
+      AssignSupplied(values, supplied, Indices{});
+      try {
+        Callback();
+      } catch (...) {
+        AssignSupplied(previous, supplied, Indices{});
+        throw;
+      }
+#else
+      AssignSupplied(values, supplied, Indices{});
+      Callback();
+#endif
+    } else {
+      AssignSupplied(values, supplied, Indices{});
+    }
+    return true;
+  }
+};
+
+/// Static dispatch table of Commands. It can be used on its own or attached to a LineProtocol with UseStaticCommands,
+/// which tries it before the runtime registration.
+template <typename... Commands>
+class StaticCommandTable {
+ public:
+  /// \param found set to false if the qualifier is not in the table.
+  static bool Dispatch(const CommandTokens& tokens, bool& found) {
+    auto qualifier = tokens[0];
+    auto hash = HashQualifier(qualifier);
+    bool ok = false;
+    found = false;
+    ((hash == Commands::hash && qualifier == Commands::qualifier ? (found = true, ok = Commands::Apply(tokens), true) : false) || ...);
+    return ok;
+  }
+
+  static bool ValidateApply(std::string_view cmd_line) {
+    CommandTokens tokens;
+    if (!Tokenize(cmd_line, tokens)) {
+      FLP_THROW(InvalidArgumentError, "Too many tokens");
+    }
+    if (tokens.empty()) {
+      FLP_THROW(InvalidArgumentError, "Empty command");
+    }
+    bool found;
+    bool ok = Dispatch(tokens, found);
+    if (!found) {
+      FLP_THROW(UnknownQualifierError, "Unknown qualifier");
+    }
+    return ok;
+  }
+};
+
+/// Counts the bytes allocated through it from an upstream resource.
+class CountingMemoryResource : public std::pmr::memory_resource {
+  std::pmr::memory_resource* upstream_;
+  size_t bytes_used_{0};
+  size_t peak_bytes_used_{0};
+
+ public:
+  explicit CountingMemoryResource(std::pmr::memory_resource* upstream) : upstream_(upstream) {}
+  [[nodiscard]] std::pmr::memory_resource* upstream() const { return upstream_; }
+  /// The bytes allocated and not released yet, without the overhead of the upstream resource.
+  [[nodiscard]] size_t GetBytesUsed() const { return bytes_used_; }
+  [[nodiscard]] size_t GetPeakBytesUsed() const { return peak_bytes_used_; }
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    void* p = upstream_->allocate(bytes, alignment);
+    bytes_used_ += bytes;
+    peak_bytes_used_ = std::max(peak_bytes_used_, bytes_used_);
+    return p;
+  }
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+    upstream_->deallocate(p, bytes, alignment);
+    bytes_used_ -= bytes;
+  }
+  [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+/// The commands and the exchange states. A LineProtocol creates its own registry, or shares the registry of another
+/// one as a session with its own input buffer, output and binary mode (see LineProtocol::GetRegistry). The commands
+/// and states are registered through any of the sessions, and the state reports are sent to all of them.
+/// Once the registration is done and the registry is frozen, it is only read, and sessions on several threads may
+/// dispatch commands from it.
+class CommandRegistry {
+  friend class LineProtocol;
+  // everything below that allocates takes its memory from here
+  CountingMemoryResource resource_;
+  CommandMap command_map_;
+  CompiledCommandTable compiled_commands_;
+  // the routing of the runtime registration, see LineProtocol::Mount
+  CommandTrie command_trie_;
+  bool frozen_{false};
+  bool (*static_dispatch_)(const CommandTokens&, bool&){nullptr};
+  BinarySchema binary_schema_;
+  bool schema_dirty_{true};
+  // the document of @flp.cmd_reg, rebuilt after a registration
+  std::pmr::string cmd_reg_cache_;
+  bool cmd_reg_dirty_{true};
+  StateSequence state_seq_{0};
+  ExchangeStateMap exchange_state_map_;
+  // the sessions that receive the state reports. A new list replaces it on every change, so a report iterates its own
+  // snapshot without a lock.
+  std::shared_ptr<const std::vector<LineProtocol*>> sessions_{std::make_shared<std::vector<LineProtocol*>>()};
+#if FLP_ENABLE_CONCURRENCY
+  // the sessions come and go on their own threads, the changes are serialized
+  std::mutex sessions_mutex_{};
+  std::atomic<size_t> session_count_{0};
+  // sessions beyond the 32 subscriber bits receive every report, read by the threads that set the states
+  std::atomic<size_t> unmasked_sessions_{0};
+#else
+  size_t session_count_{0};
+  size_t unmasked_sessions_{0};
+#endif
+  // subscriber bits in use, and of the sessions that receive the states registered from now on
+  uint32_t used_subscribers_{0};
+  SubscriberMask default_subscribers_{0};
+
+  // Grow geometrically: unordered_map::reserve rehashes to just fit n, or even shrinks the buckets, so reserving for
+  // each small batch of a growing registration would rehash every time.
+  template <typename Map>
+  static void ReserveMap(Map& map, size_t n) {
+    if (static_cast<float>(n) > static_cast<float>(map.bucket_count()) * map.max_load_factor()) {
+      map.reserve(std::max(n, 2 * map.size()));
+    }
+  }
+
+  [[nodiscard]] std::shared_ptr<const std::vector<LineProtocol*>> SessionSnapshot() const {
+#if FLP_ENABLE_CONCURRENCY
+    return std::atomic_load(&sessions_);
+#else
+    return sessions_;
+#endif
+  }
+  /// Replace the session list. The previous list is released once no report iterates it anymore, so a removed session
+  /// is not reported to after this returns.
+  void PublishSessions(std::vector<LineProtocol*> sessions) {
+    session_count_ = sessions.size();
+    std::shared_ptr<const std::vector<LineProtocol*>> retired =
+        std::make_shared<const std::vector<LineProtocol*>>(std::move(sessions));
+#if FLP_ENABLE_CONCURRENCY
+    retired = std::atomic_exchange(&sessions_, std::move(retired));
+    while (retired.use_count() > 1) {
+      std::this_thread::yield();
+    }
+    // the reports that held the list are done with its sessions
+    std::atomic_thread_fence(std::memory_order_acquire);
+#else
+    std::swap(sessions_, retired);
+#endif
+  }
+
+  /// \return the subscriber bit of the session, 0 if all bits are taken.
+  uint32_t AddSession(LineProtocol* session) {
+#if FLP_ENABLE_CONCURRENCY
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+#endif
+    auto sessions = *sessions_;
+    sessions.push_back(session);
+    PublishSessions(std::move(sessions));
+    uint32_t bit = ~used_subscribers_ & (used_subscribers_ + 1);
+    if (!bit) {
+      ++unmasked_sessions_;
+      return 0;
+    }
+    // a new session receives all the states
+    used_subscribers_ |= bit;
+    default_subscribers_ |= bit;
+    for (auto& item : exchange_state_map_) {
+      if (item.second.state) {
+        item.second.state->subscribers_ |= bit;
+      }
+    }
+    return bit;
+  }
+  void RemoveSession(LineProtocol* session, uint32_t bit) {
+#if FLP_ENABLE_CONCURRENCY
+    std::lock_guard<std::mutex> lock(sessions_mutex_);
+#endif
+    auto sessions = *sessions_;
+    sessions.erase(std::find(sessions.begin(), sessions.end(), session));
+    PublishSessions(std::move(sessions));
+    if (!bit) {
+      --unmasked_sessions_;
+      return;
+    }
+    used_subscribers_ &= ~bit;
+    default_subscribers_ &= ~bit;
+    for (auto& item : exchange_state_map_) {
+      if (item.second.state) {
+        item.second.state->subscribers_ &= ~bit;
+      }
+    }
+  }
+
+ public:
+  /// The registry allocates the commands, the states, the routing and the caches from resource, e.g. a
+  /// std::pmr::monotonic_buffer_resource over a static arena. The resource must outlive the registry.
+  explicit CommandRegistry(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+      : resource_(resource),
+        command_map_(&resource_),
+        compiled_commands_(&resource_),
+        command_trie_(&resource_),
+        binary_schema_(&resource_),
+        cmd_reg_cache_(&resource_),
+        exchange_state_map_(&resource_) {}
+  CommandRegistry(const CommandRegistry&) = delete;
+  CommandRegistry& operator=(const CommandRegistry&) = delete;
+
+  /// The bytes the registry holds from its memory resource. The callbacks are stored in place; only the heap storage of
+  /// a std::function wrapped in one is not included, nor are the sessions and their buffers.
+  [[nodiscard]] size_t GetBytesUsed() const { return resource_.GetBytesUsed(); }
+  [[nodiscard]] size_t GetPeakBytesUsed() const { return resource_.GetPeakBytesUsed(); }
+  [[nodiscard]] std::pmr::memory_resource* GetMemoryResource() { return &resource_; }
+  /// Make room for n_commands commands and n_states states in total, so the boot does not rehash repeatedly.
+  void Reserve(size_t n_commands, size_t n_states) {
+    ReserveMap(command_map_, n_commands);
+    ReserveMap(exchange_state_map_, n_states);
+  }
+  [[nodiscard]] size_t GetCommandCount() const { return command_map_.size(); }
+  [[nodiscard]] size_t GetStateCount() const { return exchange_state_map_.size(); }
+  [[nodiscard]] size_t GetSessionCount() const { return session_count_; }
+  /// Call f(LineProtocol&) for each session. It iterates a snapshot of the session list and holds no lock while f
+  /// formats and writes, so the threads that report states do not wait for each other or for sessions being added. A
+  /// session that is destroyed meanwhile waits in its destructor until f is done, so f must not destroy a session.
+  template <typename F>
+  void ForEachSession(F&& f) const {
+    auto sessions = SessionSnapshot();
+    for (auto* session : *sessions) {
+      f(*session);
+    }
+  }
+};
+
+class LineProtocol {
+ private:
+  char delim;
+  // Input storage. The unprocessed input is [head_, buf_.size()); lines are parsed in place and the consumed prefix is
+  // only dropped when Feed needs the room, so draining a burst does not shift the remaining bytes for every line.
+  std::string buf_{};
+  size_t head_{0};
+  // the delimiter search resumes here
+  size_t scan_{0};
+  BufferOverflowPolicy overflow_policy_;
+  size_t capacity_;
+  // kDiscardLine: the input is skipped until the next delimiter
+  bool discarding_{false};
+  size_t overflow_count_{0};
+  ProcessLimits limits_{};
+  // with limits_.max_line_length: where the partial line at the end of the buffer begins
+  size_t line_begin_{0};
+  // bytes the current Process call may still search, see ProcessLimits::max_scan_bytes
+  size_t scan_budget_{std::numeric_limits<size_t>::max()};
+  // lines of buf_ in use by the commands being dispatched, see InputPin
+  size_t pin_depth_{0};
+  // the input fed while buf_ is pinned
+  std::string deferred_input_{};
+  std::shared_ptr<CommandRegistry> registry_;
+  // bit of the session in ExchangeStateBase::subscribers_, 0 if the session receives every report
+  uint32_t subscriber_bit_{0};
+  // whether Subscribe has been called, before that the session receives every state by default
+  bool subscriptions_set_{false};
+  // set by RejectCommand from a callback
+  bool rejected_{false};
+  std::string reject_reason_{};
+  // the asynchronous commands waiting for their CompletionToken
+  struct InflightCommand {
+    uint32_t id;
+    // key of the command in the CommandMap
+    std::string_view qualifier;
+    int64_t started;
+  };
+  std::array<InflightCommand, FLP_MAX_INFLIGHT> inflight_{};
+  size_t n_inflight_{0};
+  uint32_t next_inflight_id_{1};
+#if FLP_ENABLE_CONCURRENCY
+  // the tokens may complete on other threads
+  mutable std::mutex inflight_mutex_{};
+#endif
+  // binary framing
+#if FLP_ENABLE_CONCURRENCY
+  std::atomic<bool> binary_mode_{false};
+#else
+  bool binary_mode_{false};
+#endif
+  // target of the argument of @flp.binary
+  int binary_enable_arg_{1};
+  // targets of the arguments of @flp.state and @flp.state.since
+  int state_offset_arg_{0};
+  int state_limit_arg_{0};
+  uint32_t state_since_arg_{0};
+  ReportMode report_mode_{ReportMode::kImmediate};
+  int64_t report_interval_{0};
+  int64_t last_flush_{0};
+  // reserved for all registered states, so scheduling a report does not allocate
+  std::vector<ExchangeStateBase*> dirty_states_{};
+
+  OutputSink sink_;
+  // see SetCapture
+  CaptureLog* capture_{nullptr};
+  OutputSink capture_sink_{[this](const char* data, size_t len) {
+    capture_->Record(CaptureKind::kOutput, Timestamp(), data, len);
+    sink_(data, len);
+  }};
+  std::array<char, FLP_RESPONSE_BUFFER_SIZE> response_buf_{};
+  // FLP_TIMESTAMP if empty
+  TimestampSource timestamp_source_{};
+  BufferedOutput buffered_output_{};
+  // see TimestampBatch
+  unsigned timestamp_batch_depth_{0};
+  bool timestamp_cached_{false};
+  int64_t cached_timestamp_{0};
+#if FLP_ENABLE_CONCURRENCY
+  std::thread::id loop_thread_{std::this_thread::get_id()};
+  std::unique_ptr<SpscByteQueue> input_queue_{};
+  std::unique_ptr<MpscOutputQueue> output_queue_{};
+  OutputSink queue_sink_{};
+#endif
+#if FLP_ENABLE_STATS
+  ProtocolStats stats_{};
+  // target of the argument of @flp.stats
+  int stats_reset_arg_{0};
+#endif
+
+  /// Measures one command for the statistics. It counts the command as failed unless Done(true) is reached.
+  class StatsScope {
+#if FLP_ENABLE_STATS
+    ProtocolStats& stats_;
+    CommandStats* command_{nullptr};
+    uint64_t start_;
+    uint64_t parsed_{0};
+    bool ok_{false};
+    // the per-command counters are written only with a private registry
+    bool shared_;
+
+   public:
+    explicit StatsScope(LineProtocol& flp) : stats_(flp.stats_), start_(FLP_STATS_CLOCK_NS), shared_(flp.SharesRegistry()) {}
+    ~StatsScope() {
+      auto end = FLP_STATS_CLOCK_NS;
+      for (auto* counter : {&stats_.commands, command_}) {
+        if (counter) {
+          ++counter->processed;
+          counter->failed += !ok_;
+        }
+      }
+      if (parsed_) {
+        stats_.parse_time.Add(parsed_ - start_);
+        stats_.dispatch_time.Add(end - parsed_);
+      } else {
+        stats_.parse_time.Add(end - start_);
+      }
+    }
+    void Command(const CommandSpec& spec) {
+      if (!shared_) {
+        command_ = &spec.stats;
+      }
+    }
+    void Parsed() { parsed_ = FLP_STATS_CLOCK_NS; }
+    bool Done(bool ok) { return ok_ = ok; }
+#else
+
+   public:
+    explicit StatsScope(LineProtocol&) {}
+    void Command(const CommandSpec&) {}
+    void Parsed() {}
+    bool Done(bool ok) { return ok; }
+#endif
+  };
+  [[nodiscard]] size_t* BytesOutCounter() {
+#if FLP_ENABLE_STATS
+    return &stats_.bytes_out;
+#else
+    return nullptr;
+#endif
+  }
+
+ public:
+  explicit LineProtocol(int buf_reserve = 150,
+                        char delim = '\n',
+                        std::ostream& ostream = std::cout,
+                        BufferOverflowPolicy overflow_policy = BufferOverflowPolicy::kGrow)
+      : LineProtocol(std::make_shared<CommandRegistry>(), buf_reserve, delim, ostream, overflow_policy) {}
+  /// A session of the registry of another LineProtocol, see CommandRegistry.
+  explicit LineProtocol(std::shared_ptr<CommandRegistry> registry,
+                        int buf_reserve = 150,
+                        char delim = '\n',
+                        std::ostream& ostream = std::cout,
+                        BufferOverflowPolicy overflow_policy = BufferOverflowPolicy::kGrow) : delim(delim),
+                                                                                             overflow_policy_(overflow_policy),
+                                                                                             capacity_(buf_reserve),
+                                                                                             registry_(std::move(registry)),
+                                                                                             sink_(OStreamSink(ostream)) {
+    buf_.reserve(buf_reserve);
+    subscriber_bit_ = registry_->AddSession(this);
+  };
+  LineProtocol(const LineProtocol&) = delete;
+  LineProtocol& operator=(const LineProtocol&) = delete;
+  ~LineProtocol() {
+    registry_->RemoveSession(this, subscriber_bit_);
+  }
+
+  [[nodiscard]] const std::shared_ptr<CommandRegistry>& GetRegistry() const { return registry_; }
+  /// \return whether other sessions dispatch from the registry too. The registry is then read only during the dispatch,
+  /// and the per-command statistics are not kept.
+  [[nodiscard]] bool SharesRegistry() const { return registry_->GetSessionCount() > 1; }
+  /// \return the session that dispatches the current command on this thread, or *this outside of the commands of its
+  /// registry. A callback registered on one session responds through it to reach the host that sent the command.
+  LineProtocol& Caller() {
+    auto* session = DispatchingSession();
+    return session && session->registry_ == registry_ ? *session : *this;
+  }
+
+ private:
+  static LineProtocol*& DispatchingSession() {
+#if FLP_ENABLE_CONCURRENCY
+    static thread_local LineProtocol* session = nullptr;
+#else
+    static LineProtocol* session = nullptr;
+#endif
+    return session;
+  }
+  /// Keeps buf_ in place while the commands of its lines are dispatched: their arguments are views into it. The input
+  /// that a command feeds meanwhile is stored once the outermost pin is released, see StoreDeferredInput.
+  class InputPin {
+    LineProtocol* session_;
+
+   public:
+    explicit InputPin(LineProtocol& session) : session_(&session) { ++session_->pin_depth_; }
+    ~InputPin() { Release(); }
+    InputPin(const InputPin&) = delete;
+    InputPin& operator=(const InputPin&) = delete;
+    void Release() {
+      if (session_) {
+        --session_->pin_depth_;
+        session_ = nullptr;
+      }
+    }
+  };
+  /// Runs the cleanup of a processing call on every exit, also when a callback throws.
+  template <typename F>
+  class ScopeExit {
+    F f_;
+
+   public:
+    explicit ScopeExit(F f) : f_(std::move(f)) {}
+    ~ScopeExit() { f_(); }
+    ScopeExit(const ScopeExit&) = delete;
+    ScopeExit& operator=(const ScopeExit&) = delete;
+  };
+  void StoreDeferredInput() {
+    if (pin_depth_ == 0 && !deferred_input_.empty()) {
+      Store(deferred_input_.data(), deferred_input_.size());
+      deferred_input_.clear();
+    }
+  }
+  /// Makes the session the one that dispatches, see Caller.
+  class DispatchScope {
+    LineProtocol* previous_;
+
+   public:
+    explicit DispatchScope(LineProtocol& session) : previous_(DispatchingSession()) { DispatchingSession() = &session; }
+    ~DispatchScope() { DispatchingSession() = previous_; }
+    DispatchScope(const DispatchScope&) = delete;
+    DispatchScope& operator=(const DispatchScope&) = delete;
+  };
+  /// Spec of an argument of an internal command. The value is stored in the member of the session that dispatches the
+  /// command, so the sessions of a shared registry do not write each other's arguments.
+  template <typename T>
+  ArgumentSpec SessionArgument(T LineProtocol::*member, bool optional, const Validator& validator = nullptr) {
+    ArgumentSpec spec(this->*member, optional, validator);
+    spec.setter = [member](const NumericValue& v) { DispatchingSession()->*member = v.As<T>(); };
+    spec.getter = [member]() { return NumericValue::Of(DispatchingSession()->*member); };
+    return spec;
+  }
+
+ private:
+  /// The frames of the binary mode end with 0x00.
+  [[nodiscard]] char InputDelimiter() const { return binary_mode_ ? '\0' : delim; }
+
+  /// Drop the consumed prefix. Only the pending bytes are moved.
+  void Compact() {
+    if (head_ == 0) {
+      return;
+    }
+    buf_.erase(0, head_);
+    scan_ -= head_;
+    line_begin_ -= std::min(line_begin_, head_);
+    head_ = 0;
+  }
+  void Clear() {
+    buf_.clear();
+    head_ = scan_ = line_begin_ = 0;
+  }
+  /// Append to the buffer and move line_begin_ past the last delimiter of the data.
+  void Put(const char* data, size_t len) {
+    buf_.append(data, len);
+    if (!limits_.max_line_length) {
+      return;
+    }
+    for (size_t i = len; i > 0; --i) {
+      if (data[i - 1] == InputDelimiter()) {
+        line_begin_ = buf_.size() - len + i;
+        break;
+      }
+    }
+  }
+  void FindLineBegin() {
+    auto last_delim = buf_.rfind(InputDelimiter());
+    line_begin_ = last_delim == std::string::npos ? 0 : last_delim + 1;
+  }
+  /// Discard the partial line if it exceeds limits_.max_line_length, with its input up to the next delimiter.
+  void LimitLineLength() {
+    auto begin = std::max(line_begin_, head_);
+    if (!limits_.max_line_length || buf_.size() - begin <= limits_.max_line_length) {
+      return;
+    }
+    ++overflow_count_;
+    buf_.resize(begin);
+    scan_ = std::min(scan_, begin);
+    discarding_ = true;
+  }
+  /// The delimiter in [scan_, buf_.size()) within the scan budget, npos if there is none. scan_ moves past the bytes
+  /// searched without a match.
+  size_t FindDelimiter() {
+    auto window = std::min(buf_.size() - scan_, scan_budget_);
+    auto* found = static_cast<const char*>(std::memchr(buf_.data() + scan_, InputDelimiter(), window));
+    if (!found) {
+      scan_budget_ -= window;
+      scan_ += window;
+      return std::string::npos;
+    }
+    auto pos = static_cast<size_t>(found - buf_.data());
+    scan_budget_ -= pos - scan_ + 1;
+    return pos;
+  }
+  void ResetScanBudget() {
+    scan_budget_ = limits_.max_scan_bytes ? limits_.max_scan_bytes : std::numeric_limits<size_t>::max();
+  }
+  [[nodiscard]] bool IsLineTooLong(std::string_view line) const {
+    return limits_.max_line_length && line.size() > limits_.max_line_length;
+  }
+  [[nodiscard]] size_t MaxTokens() const {
+    return limits_.max_tokens ? std::min<size_t>(limits_.max_tokens, FLP_MAX_TOKENS) : FLP_MAX_TOKENS;
+  }
+
+  void CountInput([[maybe_unused]] size_t len) {
+#if FLP_ENABLE_STATS
+    stats_.bytes_in += len;
+    stats_.buffer_high_water = std::max(stats_.buffer_high_water, buf_.size() - head_);
+#endif
+  }
+
+  /// Append, count and capture the input.
+  size_t Store(const char* buffer, size_t len, bool capture = true) {
+    auto taken = Append(buffer, len);
+    LimitLineLength();
+    CountInput(taken);
+    if (capture && capture_) {
+      capture_->Record(CaptureKind::kInput, Timestamp(), buffer, taken);
+    }
+    return taken;
+  }
+  [[nodiscard]] const OutputSink& OutputTarget() const { return capture_ ? capture_sink_ : sink_; }
+
+  /// Store the input according to the overflow policy, see Feed.
+  size_t Append(const char* buffer, size_t len) {
+    if (head_ == buf_.size()) {
+      // everything is consumed, reuse the storage from the beginning
+      Clear();
+    }
+    if (overflow_policy_ == BufferOverflowPolicy::kGrow) {
+      size_t skipped = 0;
+      if (discarding_) {
+        // the rest of a line longer than limits_.max_line_length
+        auto delim_pos = std::memchr(buffer, InputDelimiter(), len);
+        if (!delim_pos) {
+          return len;
+        }
+        skipped = static_cast<const char*>(delim_pos) - buffer + 1;
+        discarding_ = false;
+      }
+      // amortized: the pending bytes are moved only once the consumed prefix is at least as large
+      if (head_ >= buf_.size() - head_) {
+        Compact();
+      }
+      Put(buffer + skipped, len - skipped);
+      return len;
+    }
+
+    size_t taken = 0;
+    while (taken < len) {
+      if (discarding_) {
+        auto delim_pos = std::memchr(buffer + taken, InputDelimiter(), len - taken);
+        if (!delim_pos) {
+          return len;
+        }
+        taken = static_cast<const char*>(delim_pos) - buffer + 1;
+        discarding_ = false;
+        continue;
+      }
+      if (buf_.size() + (len - taken) > capacity_) {
+        Compact();
+      }
+      size_t room = capacity_ - buf_.size();
+      if (len - taken <= room) {
+        Put(buffer + taken, len - taken);
+        return len;
+      }
+      ++overflow_count_;
+      if (overflow_policy_ == BufferOverflowPolicy::kReject) {
+        Put(buffer + taken, room);
+        taken += room;
+        if (buf_.size() == capacity_ && buf_.find(InputDelimiter(), scan_) == std::string::npos) {
+          // the pending line takes the whole buffer and can never complete
+          Clear();
+          discarding_ = true;
+          continue;
+        }
+        return taken;
+      }
+      // kDiscardLine: keep the complete lines and drop the partial one
+      auto last_delim = buf_.rfind(InputDelimiter());
+      size_t keep = (last_delim == std::string::npos || last_delim < head_) ? head_ : last_delim + 1;
+      buf_.resize(keep);
+      scan_ = std::min(scan_, keep);
+      line_begin_ = std::min(line_begin_, keep);
+      discarding_ = true;
+    }
+    return taken;
+  }
+
+ public:
+  /// Append the input to the buffer. The input fed by a command while it is dispatched is stored when the dispatch
+  /// returns, so the arguments of the command stay valid. It is all taken then, the overflow policy applies on storing.
+  /// \return number of bytes taken from the input. It is less than len only with BufferOverflowPolicy::kReject.
+  size_t Feed(const char* buffer, size_t len) {
+    if (pin_depth_) {
+      deferred_input_.append(buffer, len);
+      return len;
+    }
+    StoreDeferredInput();
+    return Store(buffer, len);
+  }
+  size_t Feed(std::string_view str) {
+    return Feed(str.data(), str.size());
+  }
+  /// \return the input that has not been processed yet.
+  [[nodiscard]] std::string_view GetBuffer() const {
+    return std::string_view(buf_).substr(head_);
+  }
+  /// \return number of times the input did not fit in a fixed-capacity buffer, or a line exceeded
+  /// ProcessLimits::max_line_length.
+  [[nodiscard]] size_t GetOverflowCount() const { return overflow_count_; }
+  /// Bound the work of each Process call and the memory of a partial line, so malformed input such as a line without a
+  /// delimiter or thousands of tokens cannot stall the loop.
+  void SetProcessLimits(const ProcessLimits& limits) {
+    limits_ = limits;
+    FindLineBegin();
+    LimitLineLength();
+  }
+  [[nodiscard]] const ProcessLimits& GetProcessLimits() const { return limits_; }
+#if FLP_ENABLE_STATS
+  [[nodiscard]] const ProtocolStats& GetStats() const { return stats_; }
+  void ResetStats() {
+    stats_ = {};
+    if (SharesRegistry()) {
+      return;
+    }
+    for (auto& item : registry_->command_map_) {
+      item.second.stats = {};
+    }
+  }
+#endif
+  void SetOStream(std::ostream& ostream) {
+    SetOutputSink(OStreamSink(ostream));
+  }
+  /// Send the output to the sink instead of an ostream.
+  void SetOutputSink(OutputSink sink) {
+    sink_ = std::move(sink);
+    buffered_output_ = {};
+  }
+  /// Record the input chunks and the output with their timestamps in a CaptureLog, nullptr stops. The log belongs to
+  /// the loop thread: with FLP_ENABLE_CONCURRENCY the other threads must respond through the output queue.
+  void SetCapture(CaptureLog* log) {
+    capture_ = log;
+  }
+  static OutputSink OStreamSink(std::ostream& ostream) {
+    return [os = &ostream](const char* data, size_t len) { os->write(data, static_cast<std::streamsize>(len)); };
+  }
+
+  /// Collect the output in a BufferedOutput and hand it to a non-blocking writer, instead of waiting for the sink on
+  /// every response. Call Tick or FlushOutput from the main loop to write the rest. SetOStream or SetOutputSink
+  /// removes the stage.
+  void SetBufferedOutput(OutputWriter writer, const BufferedOutputConfig& config = {}) {
+    buffered_output_ = BufferedOutput(std::move(writer), config);
+    sink_ = [this](const char* data, size_t len) { buffered_output_.Write(data, len); };
+  }
+  /// \return whether all the buffered output has been written.
+  bool FlushOutput() {
+    return buffered_output_.Flush();
+  }
+  /// Call it when the transfer started by an asynchronous writer has finished.
+  void CompleteOutput() {
+    buffered_output_.Complete();
+  }
+  [[nodiscard]] const BufferedOutput& GetBufferedOutput() const { return buffered_output_; }
+
+  /// \return whether the caller runs on the thread that constructed the LineProtocol. Always true without
+  /// FLP_ENABLE_CONCURRENCY.
+  [[nodiscard]] bool OnLoopThread() const {
+#if FLP_ENABLE_CONCURRENCY
+    return std::this_thread::get_id() == loop_thread_;
+#else
+    return true;
+#endif
+  }
+  /// \return whether the caller may write output to this session: on the loop thread, or on any thread with the
+  /// output queue.
+  [[nodiscard]] bool CanWriteFromThisThread() const {
+#if FLP_ENABLE_CONCURRENCY
+    return output_queue_ || OnLoopThread();
+#else
+    return true;
+#endif
+  }
+
+#if FLP_ENABLE_CONCURRENCY
+  /// Allocate the queue of QueueInput. Call it before the producer starts.
+  void EnableInputQueue(size_t capacity) {
+    input_queue_ = std::make_unique<SpscByteQueue>(capacity);
+  }
+  /// Feed from one producer thread or interrupt while the loop thread processes. The bytes are moved into the buffer
+  /// by the next Process or ProcessBatch, where the overflow policy applies.
+  /// \return number of bytes taken, less than len if the queue is full.
+  size_t QueueInput(const char* buffer, size_t len) {
+    return input_queue_->Push(buffer, len);
+  }
+  size_t QueueInput(std::string_view str) {
+    return QueueInput(str.data(), str.size());
+  }
+
+  /// Route all responses and state reports through a lock-free queue of n_cells cells of FLP_OUTPUT_CELL_SIZE bytes,
+  /// so any thread can respond without blocking on the sink. The loop thread writes the queued output to the sink in
+  /// DrainOutput, which Process, ProcessBatch and Tick call. Call it before the other threads start.
+  /// A state set by another thread is reported right away even in the coalesced mode, and one thread at a time may
+  /// set a state. A response longer than FLP_RESPONSE_BUFFER_SIZE may be interleaved with the responses of other
+  /// threads.
+  void EnableOutputQueue(size_t n_cells) {
+    output_queue_ = std::make_unique<MpscOutputQueue>(n_cells);
+    queue_sink_ = [this](const char* data, size_t len) { output_queue_->Push(data, len); };
+    // the ids are read by the other threads
+    GetBinarySchema();
+  }
+  /// Write the queued output to the sink. Call it from the loop thread.
+  void DrainOutput() {
+    if (!output_queue_) {
+      return;
+    }
+    {
+      // collect the cells into larger writes
+      ResponseWriter writer(response_buf_.data(), response_buf_.size(), OutputTarget(), false, BytesOutCounter());
+      output_queue_->Drain([&](const char* data, size_t len) { writer.Write(std::string_view(data, len)); });
+    }
+    // the drained batch is staged like one response, it is dropped as a whole if it does not fit
+    if (buffered_output_.IsActive()) {
+      buffered_output_.EndResponse(binary_mode_ ? '\0' : '\n');
+    }
+  }
+  /// \return number of responses dropped because the output queue was full.
+  [[nodiscard]] size_t GetDroppedOutputCount() const {
+    return output_queue_ ? output_queue_->GetDroppedCount() : 0;
+  }
+#endif
+
+ private:
+  void DrainInput() {
+    StoreDeferredInput();
+#if FLP_ENABLE_CONCURRENCY
+    if (input_queue_) {
+      input_queue_->Drain([&](const char* data, size_t len) { Store(data, len); });
+    }
+#endif
+  }
+  void DrainQueuedOutput() {
+#if FLP_ENABLE_CONCURRENCY
+    DrainOutput();
+#endif
+  }
+  /// The text value of a state in @flp.state and @flp.state.since. Floating point states keep the fixed format with 6
+  /// decimals of the std::to_string output of the earlier versions, e.g. 2.560000, so the clients see the same text.
+  static void WriteStateValue(ResponseWriter& writer, const ExchangeStateInterface& state) {
+    auto value = state.getter();
+    if (value.type == BinaryType::kFloat) {
+      writer.WriteValue(static_cast<float>(value.float_val), 6);
+    } else if (!value.is_int) {
+      writer.WriteValue(value.float_val, 6);
+    } else {
+      writer.WriteValue(value.int_val);
+    }
+  }
+  /// A writer of one response. With the output queue, the response goes to the queue, and the other threads format it
+  /// in a buffer of their own.
+  ResponseWriter MakeWriter(bool binary) {
+#if FLP_ENABLE_CONCURRENCY
+    if (output_queue_) {
+      if (!OnLoopThread()) {
+        thread_local std::array<char, FLP_RESPONSE_BUFFER_SIZE> thread_buf;
+        return ResponseWriter(thread_buf.data(), thread_buf.size(), queue_sink_, binary);
+      }
+      // the output is counted when it is drained
+      return ResponseWriter(response_buf_.data(), response_buf_.size(), queue_sink_, binary);
+    }
+#endif
+    return ResponseWriter(response_buf_.data(), response_buf_.size(), OutputTarget(), binary, BytesOutCounter(),
+                          buffered_output_.IsActive() ? &buffered_output_ : nullptr);
+  }
+
+ public:
+  /// Replace the clock of the timestamps, e.g. by a cycle counter or a tick variable. nullptr restores FLP_TIMESTAMP.
+  /// The report interval of the coalesced mode is in the unit of this source.
+  void SetTimestampSource(TimestampSource source) {
+    timestamp_source_ = std::move(source);
+    timestamp_cached_ = false;
+  }
+  /// Milliseconds of std::chrono::steady_clock.
+  static TimestampSource SteadyClockSource() {
+    return []() {
+      return static_cast<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                      std::chrono::steady_clock::now().time_since_epoch())
+                                      .count());
+    };
+  }
+  /// \return the current timestamp. Within a TimestampBatch the clock is read once and the value is reused.
+  int64_t Timestamp() {
+    if (!OnLoopThread()) {
+      // the batch belongs to the loop thread
+      return timestamp_source_ ? timestamp_source_() : static_cast<int64_t>(FLP_TIMESTAMP);
+    }
+    if (timestamp_cached_) {
+      return cached_timestamp_;
+    }
+    int64_t now = timestamp_source_ ? timestamp_source_() : static_cast<int64_t>(FLP_TIMESTAMP);
+    if (timestamp_batch_depth_ > 0) {
+      cached_timestamp_ = now;
+      timestamp_cached_ = true;
+    }
+    return now;
+  }
+
+  /// While it exists, the responses of the LineProtocol share one clock read, taken when the first of them needs it.
+  /// Nested batches share the read of the outermost one. ProcessBatch and FlushStates open a batch.
+  class TimestampBatch {
+    LineProtocol& flp_;
+
+   public:
+    explicit TimestampBatch(LineProtocol& flp) : flp_(flp) { ++flp_.timestamp_batch_depth_; }
+    TimestampBatch(const TimestampBatch&) = delete;
+    TimestampBatch& operator=(const TimestampBatch&) = delete;
+    ~TimestampBatch() {
+      if (--flp_.timestamp_batch_depth_ == 0) {
+        flp_.timestamp_cached_ = false;
+      }
+    }
+  };
+
+ private:
+  /// A validated argument waiting to be applied.
+  using ParsedArgument = CommandArgument;
+
+  // Scratch key for the map lookups. Its capacity is reused so the lookups do not allocate once it has grown.
+  std::pmr::string key_buf_{};
+  const std::pmr::string& Key(std::string_view name) {
+    key_buf_.assign(name.data(), name.size());
+    return key_buf_;
+  }
+
+ public:
+  /// Validate the command line and apply the arguments. The line is parsed in place: the tokens are views into
+  /// `cmd_line` and no heap allocation is made unless the command has a callback, which receives the argument maps.
+  bool ValidateApply(std::string_view cmd_line) {
+    StatsScope stats(*this);
+    TokenArray<FLP_MAX_TOKENS> tokens;
+    if (!Tokenize(cmd_line, tokens) || tokens.size() > MaxTokens()) {
+      FLP_THROW(InvalidArgumentError, "Too many tokens");
+    }
+    if (tokens.empty()) {
+      FLP_THROW(InvalidArgumentError, "Empty command");
+    }
+    if (registry_->static_dispatch_) {
+      bool found_static;
+      bool ok = registry_->static_dispatch_(tokens, found_static);
+      if (found_static) {
+        return stats.Done(ok);
+      }
+    }
+    // check if the qualifier is valid
+    const CompiledCommandTable::Command* compiled = nullptr;
+    const CommandSpec* found = nullptr;
+    if (registry_->frozen_) {
+      compiled = registry_->compiled_commands_.Find(tokens[0]);
+      found = compiled ? compiled->spec : nullptr;
+    }
+    if (!found) {
+      // the mounted namespaces are only in the trie
+      auto match = registry_->command_trie_.Find(tokens[0]);
+      if (match.delegate) {
+        // the child parses the rest of the line in place
+        auto rest = cmd_line.substr(tokens[0].data() - cmd_line.data() + match.prefix_len);
+        return stats.Done(match.delegate->ValidateApply(rest));
+      }
+      found = match.spec;
+    }
+    if (!found) {
+      FLP_THROW(UnknownQualifierError, "Unknown qualifier");
+    }
+
+    const auto& command = *found;
+    stats.Command(command);
+    auto& arg_map = command.arg_map;
+    std::array<ParsedArgument, FLP_MAX_TOKENS> parsed_args;
+    size_t n_parsed = 0;
+    ArgumentMask supplied = 0;
+    // check if the arguments are valid
+    for (size_t i = 1; i < tokens.size(); ++i) {
+      auto token = tokens[i];
+      // the tokenizer found the '='
+      auto eq_pos = tokens.EqualsPos(i);
+      if (eq_pos == std::string_view::npos) {
+        FLP_THROW(InvalidArgumentError, "Invalid argument: " + std::string(token));
+      }
+      auto arg_name = token.substr(0, eq_pos);
+      auto arg_value = token.substr(eq_pos + 1);
+
+      if (arg_value.empty()) {
+        // test arg=\n
+        FLP_THROW(InvalidArgumentError, std::string(token) + " incomplete pair");
+      }
+
+      NumericValue value;
+      if (!ParseNumericValue(arg_value, value)) {
+        FLP_THROW(InvalidArgumentError, std::string(token) + " value is not numeric");
+      }
+
+      // check if the arg_name exists
+      const ArgumentSpec* found_arg;
+      if (compiled) {
+        found_arg = registry_->compiled_commands_.FindArgument(*compiled, arg_name);
+      } else {
+        auto it = arg_map.find(Key(arg_name));
+        found_arg = it == arg_map.end() ? nullptr : &it->second;
+      }
+      if (!found_arg) {
+        // non existing arg
+        parsed_args[n_parsed++] = {arg_name, value, nullptr};
+      } else {
+        // existing in the spec
+        if (!CheckArgument(*found_arg, value, token)) {
+          return false;
+        }
+        parsed_args[n_parsed++] = {arg_name, value, found_arg};
+        supplied |= ArgumentMask{1} << found_arg->slot;
+      }
+    }
+
+    stats.Parsed();
+    return stats.Done(ApplyArguments(command, parsed_args.data(), n_parsed, supplied));
+  }
+
+  /// Validate and apply a decoded binary frame: the command id (u16) followed by the arguments, each of them an argument
+  /// id (u8) and a tagged value. See BinarySchema and BinaryType.
+  bool ValidateApplyBinary(std::string_view frame) {
+    StatsScope stats(*this);
+    if (frame.size() < 2) {
+      FLP_THROW(InvalidArgumentError, "Incomplete frame");
+    }
+    auto& schema = GetBinarySchema();
+    auto id = ReadLE<uint16_t>(frame.data());
+    if (id >= schema.commands.size()) {
+      FLP_THROW(UnknownQualifierError, "Unknown command id");
+    }
+    auto& command = schema.commands[id];
+    stats.Command(*command.spec);
+    frame.remove_prefix(2);
+
+    std::array<ParsedArgument, FLP_MAX_TOKENS> parsed_args;
+    size_t n_parsed = 0;
+    ArgumentMask supplied = 0;
+    while (!frame.empty()) {
+      auto arg_id = static_cast<uint8_t>(frame[0]);
+      frame.remove_prefix(1);
+      NumericValue value;
+      if (!ReadBinaryValue(frame, value)) {
+        FLP_THROW(InvalidArgumentError, "Incomplete frame");
+      }
+      if (arg_id >= command.args.size()) {
+        FLP_THROW(InvalidArgumentError, "Unknown argument id");
+      }
+      // the command id counts as a token of limits_.max_tokens
+      if (n_parsed == parsed_args.size() || (limits_.max_tokens && n_parsed + 1 >= limits_.max_tokens)) {
+        FLP_THROW(InvalidArgumentError, "Too many tokens");
+      }
+      auto& arg = command.args[arg_id];
+      if (!CheckArgument(*arg.spec, value, arg.name)) {
+        return false;
+      }
+      parsed_args[n_parsed++] = {arg.name, value, arg.spec};
+      supplied |= ArgumentMask{1} << arg_id;
+    }
+    stats.Parsed();
+    return stats.Done(ApplyArguments(*command.spec, parsed_args.data(), n_parsed, supplied));
+  }
+
+ private:
+  /// Check a value against the spec of its argument.
+  /// \param what the argument as it appears in the error messages.
+  bool CheckArgument(const ArgumentSpec& spec, const NumericValue& value, [[maybe_unused]] std::string_view what) {
+    // should be int but a float is given, error.
+    if (!spec.is_float && !value.is_int) {
+      FLP_THROW(InvalidArgumentError, std::string(what) + "  should be int");
+    }
+    if (!spec.is_float && (value.int_val < spec.int_min || value.int_val > spec.int_max)) {
+      FLP_THROW(InvalidArgumentError, std::string(what) + " is out of range");
+    }
+
+    // validator was set, it should return true if valid.
+    if (spec.validator && !spec.validator(value.As<double>())) {
+      FLP_THROW(ValidatorError, std::string(what) + " validation failed");
+    }
+    return true;
+  }
+
+  /// Check the required arguments, apply the checked arguments and invoke the callback.
+  /// \param supplied the slots of the predefined arguments in parsed_args.
+  bool ApplyArguments(const CommandSpec& command, const ParsedArgument* parsed_args, size_t n_parsed, ArgumentMask supplied) {
+    // check if all required arguments are supplied
+    if (auto missing = command.required_mask & ~supplied) {
+      size_t slot = 0;
+      while (!(missing >> slot & 1)) {
+        ++slot;
+      }
+      FLP_THROW(InvalidArgumentError, std::string(command.ArgumentAt(slot)->first) + " is required");
+    }
+
+    // All check has passed, now apply the arguments.
+    DispatchScope dispatch(*this);
+    uint32_t inflight_id = 0;
+    if (command.async_handler) {
+      inflight_id = BeginInflight(command.qualifier);
+      if (!inflight_id) {
+        FLP_THROW(CallbackError, "Too many commands in flight");
+      }
+    }
+    if (!command.callback && !command.handler && !command.async_handler) {
+      // nothing can fail from here
+      for (size_t i = 0; i < n_parsed; ++i) {
+        if (parsed_args[i].spec) {
+          parsed_args[i].spec->setter(parsed_args[i].value);
+        }
+      }
+      return true;
+    }
+    // the callback may fail: keep the previous values to roll back
+    std::array<NumericValue, FLP_MAX_TOKENS> previous;
+    for (size_t i = 0; i < n_parsed; ++i) {
+      if (parsed_args[i].spec && parsed_args[i].spec->getter) {
+        previous[i] = parsed_args[i].spec->getter();
+      }
+    }
+    for (size_t i = 0; i < n_parsed; ++i) {
+      if (parsed_args[i].spec) {
+        parsed_args[i].spec->setter(parsed_args[i].value);
+      }
+    }
+    auto rollback = [&]() {
+      // backwards, so a repeated argument gets the value from before the command
+      for (size_t i = n_parsed; i-- > 0;) {
+        if (parsed_args[i].spec && parsed_args[i].spec->getter) {
+          parsed_args[i].spec->setter(previous[i]);
+        }
+      }
+      // the command failed before it went asynchronous
+      EndInflight(inflight_id);
+    };
+
+    auto invoke = [&]() {
+      if (command.async_handler) {
+        command.async_handler(CommandArguments(parsed_args, n_parsed, supplied), CompletionToken(this, inflight_id));
+        return;
+      }
+      if (command.handler) {
+        command.handler(CommandArguments(parsed_args, n_parsed, supplied));
+        return;
+      }
+      RawArgumentMap predefined_arg_map, undefined_arg_map;
+      for (size_t i = 0; i < n_parsed; ++i) {
+        auto& target = parsed_args[i].spec ? predefined_arg_map : undefined_arg_map;
+        target[std::string(parsed_args[i].name)] = parsed_args[i].value.As<float>();
+      }
+      command.callback(predefined_arg_map, undefined_arg_map);
+    };
+    rejected_ = false;
+#ifdef __EXCEPTIONS
+    try {
+      invoke();
+    } catch (...) {
+      rollback();
+      throw;
+    }
+#else
+    invoke();
+#endif
+    if (rejected_) {
+      rejected_ = false;
+      rollback();
+      FLP_THROW(CallbackError, reject_reason_);
+    }
+    return true;
+  }
+
+ public:
+  /// Fail the command from its callback, also without exceptions. The arguments are restored to their values before
+  /// the command and ValidateApply fails with CallbackError once the callback returns.
+  void RejectCommand(std::string_view reason) {
+    rejected_ = true;
+    reject_reason_.assign(reason.data(), reason.size());
+  }
+
+  /// \return the number of asynchronous commands of this session waiting for their CompletionToken.
+  [[nodiscard]] size_t GetInflightCount() const {
+#if FLP_ENABLE_CONCURRENCY
+    std::lock_guard<std::mutex> lock(inflight_mutex_);
+#endif
+    return n_inflight_;
+  }
+
+ private:
+  friend class CompletionToken;
+  /// \return the id of the new in-flight command, 0 if FLP_MAX_INFLIGHT commands are in flight.
+  uint32_t BeginInflight(std::string_view qualifier) {
+    auto started = Timestamp();
+#if FLP_ENABLE_CONCURRENCY
+    std::lock_guard<std::mutex> lock(inflight_mutex_);
+#endif
+    if (n_inflight_ == inflight_.size()) {
+      return 0;
+    }
+    uint32_t id = next_inflight_id_++;
+    if (!next_inflight_id_) {
+      // 0 is not an id
+      next_inflight_id_ = 1;
+    }
+    inflight_[n_inflight_++] = {id, qualifier, started};
+    return id;
+  }
+  /// Remove the in-flight command. \return false if it is not in flight.
+  bool EndInflight(uint32_t id, std::string_view* qualifier = nullptr) {
+    if (!id) {
+      return false;
+    }
+#if FLP_ENABLE_CONCURRENCY
+    std::lock_guard<std::mutex> lock(inflight_mutex_);
+#endif
+    for (size_t i = 0; i < n_inflight_; ++i) {
+      if (inflight_[i].id == id) {
+        if (qualifier) {
+          *qualifier = inflight_[i].qualifier;
+        }
+        // keep the order of dispatch for @flp.inflight
+        std::move(inflight_.begin() + i + 1, inflight_.begin() + n_inflight_, inflight_.begin() + i);
+        --n_inflight_;
+        return true;
+      }
+    }
+    return false;
+  }
+  /// Forget the in-flight commands of a command that is unregistered, their tokens complete nothing.
+  void DropInflight(std::string_view qualifier) {
+#if FLP_ENABLE_CONCURRENCY
+    std::lock_guard<std::mutex> lock(inflight_mutex_);
+#endif
+    auto end = std::remove_if(inflight_.begin(), inflight_.begin() + n_inflight_,
+                              [&](const InflightCommand& command) { return command.qualifier.data() == qualifier.data(); });
+    n_inflight_ = static_cast<size_t>(end - inflight_.begin());
+  }
 
  private:
-  std::string name_;
-  T state_;
+  /// Take the next non-blank line, or the next non-empty frame in the binary mode, out of the buffer.
+  /// \return false if there is no complete line.
+  bool NextLine(std::string_view& line) {
+    while (true) {
+      // check if there is a delim in the buffer. The bytes before scan_ were searched by the previous calls.
+      auto found = FindDelimiter();
+      if (found == std::string::npos) {
+        // no delim, or the scan budget is spent
+        return false;
+      }
+
+      // the line stays in the buffer until Feed needs the room
+      line = std::string_view(buf_.data() + head_, found - head_);
+      head_ = scan_ = found + 1;
+
+      if (IsLineTooLong(line)) {
+        ++overflow_count_;
+        continue;
+      }
+      if (line.empty() || (!binary_mode_ && line.find_first_not_of(' ') == std::string_view::npos)) {
+        // ignore multiple \n\n\n or \n[space]\n
+        continue;
+      }
+      return true;
+    }
+  }
 
-  std::function<float()> getter_ = [&]() { return (float)Get(); };
-  std::function<void(float)> setter_ = [&](float v) { Set((T)v); };
+  /// Validate and apply a line from the buffer, or a frame in the binary mode.
+  bool Dispatch(std::string_view line) {
+    InputPin pin(*this);
+    if (binary_mode_) {
+      // the frame is decoded in place. It has been consumed from the buffer already.
+      char* frame = buf_.data() + (line.data() - buf_.data());
+      auto len = CobsDecode(frame, line.size());
+      if (len == SIZE_MAX) {
+        FLP_THROW(InvalidArgumentError, "Malformed frame");
+      }
+      return ValidateApplyBinary(std::string_view(frame, len));
+    }
+    return ValidateApply(line);
+  }
 
  public:
-  bool report_state{true};
-  // affect the output precision when T is float
-  int n_decimal{-1};
+  /// Process will only process one valid command once.
+  /// However, if there are consecutive CR, they will be purged.
+  /// \return
+  bool Process() {
+    DrainInput();
+    ResetScanBudget();
+    ScopeExit finish([this]() {
+      StoreDeferredInput();
+      DrainQueuedOutput();
+    });
+    std::string_view cmd_str;
+    if (!NextLine(cmd_str)) {
+      return false;
+    }
+    return Dispatch(cmd_str);
+  }
 
-  explicit ExchangeState(LineProtocol& flp, const std::string& name);
-  const T& Get() const { return state_; }
-  [[nodiscard]] const std::function<float()>& Getter() const {
-    return getter_;
+  /// Dispatch up to max_commands complete lines in one pass over the buffer. A failing command does not stop the batch;
+  /// the failures are counted in the summary instead of being thrown.
+  ProcessSummary ProcessBatch(size_t max_commands) {
+    ResetScanBudget();
+    return ProcessLines(max_commands);
   }
-  [[nodiscard]] std::function<void(float)>& Setter() {
-    return setter_;
+
+  /// Dispatch all complete lines in the buffer. See ProcessBatch.
+  ProcessSummary ProcessAll() {
+    return ProcessBatch(std::numeric_limits<size_t>::max());
   }
-  [[nodiscard]] const std::string& GetName() const { return name_; }
-  void Set(const T& other) {
-    state_ = other;
-    if (report_state) {
-      ReportState();
+
+  /// Process the complete lines of an external buffer, such as the receive region of a DMA ring, where they are. Only
+  /// a trailing partial line is copied into the internal buffer, it is completed by the next Feed or ProcessBuffer.
+  /// The lines beyond max_commands are copied too. The buffer can be reused once the call returns. With
+  /// BufferOverflowPolicy::kReject, the copied part may not fit; ProcessSummary::taken tells where to continue then.
+  /// The frames of the binary mode are decoded in place, so in that mode the input is fed and processed as usual.
+  ProcessSummary ProcessBuffer(const char* data, size_t len, size_t max_commands = std::numeric_limits<size_t>::max()) {
+    if (binary_mode_) {
+      auto fed = Feed(data, len);
+      auto summary = ProcessBatch(max_commands);
+      summary.taken = fed;
+      return summary;
+    }
+    StoreDeferredInput();
+    ResetScanBudget();
+    TimestampBatch timestamps(*this);
+    // the input fed by the commands goes after the rest of the chunk
+    InputPin pin(*this);
+    ProcessSummary summary;
+    const char* start = data;
+    const char* end = data + len;
+    const char* begin = data;
+    // the rest of the chunk is copied even if a callback throws, the caller reuses the buffer
+    bool rest_stored = false;
+    size_t rest_taken = 0;
+    auto store_rest = [&]() {
+      if (!rest_stored) {
+        rest_stored = true;
+        CountInput(data - begin);
+        rest_taken = data < end ? Store(data, end - data, false) : 0;
+      }
+    };
+    ScopeExit finish([&]() {
+      store_rest();
+      pin.Release();
+      StoreDeferredInput();
+      DrainQueuedOutput();
+    });
+    // the whole chunk, before the responses to its lines
+    if (capture_) {
+      capture_->Record(CaptureKind::kInput, Timestamp(), data, len);
+    }
+    if (discarding_ || head_ != buf_.size()) {
+      // complete the pending line in the internal buffer first
+      auto* delim_pos = static_cast<const char*>(std::memchr(data, delim, std::min(len, scan_budget_)));
+      size_t n = delim_pos ? delim_pos - data + 1 : len;
+      auto stored = Store(data, n, false);
+      summary = ProcessLines(max_commands);
+      if (stored < n) {
+        // rejected: nothing after the stored part is taken, in order to keep the order of the lines
+        end = data + stored;
+        n = stored;
+      }
+      begin = data += n;
     }
+    // a command can switch to the binary mode, the rest is kept for the next call then
+    while (data < end && summary.processed < max_commands && !binary_mode_) {
+      auto window = std::min(static_cast<size_t>(end - data), scan_budget_);
+      auto* delim_pos = static_cast<const char*>(std::memchr(data, delim, window));
+      if (!delim_pos) {
+        scan_budget_ -= window;
+        break;
+      }
+      scan_budget_ -= delim_pos - data + 1;
+      std::string_view line(data, delim_pos - data);
+      data = delim_pos + 1;
+      if (IsLineTooLong(line)) {
+        ++overflow_count_;
+      } else if (line.find_first_not_of(' ') != std::string_view::npos) {
+        DispatchCounted(line, summary);
+      }
+    }
+    store_rest();
+    summary.taken = static_cast<size_t>(data - start) + rest_taken;
+    return summary;
   }
-  void ReportState();
-  ExchangeState<T>& operator=(const T& other) {
-    Set(other);
-    return *this;
+  ProcessSummary ProcessBuffer(std::string_view str) {
+    return ProcessBuffer(str.data(), str.size());
   }
-};
 
-class LineProtocol {
  private:
-  char delim;
-  std::string buf_{};
-  CommandMap command_map_{};
-  ExchangeStateMap exchange_state_map_{};
-
-  std::reference_wrapper<std::ostream> ostream_;
+  /// Dispatch up to max_commands lines of the buffer within the scan budget.
+  ProcessSummary ProcessLines(size_t max_commands) {
+    DrainInput();
+    TimestampBatch timestamps(*this);
+    ScopeExit finish([this]() { DrainQueuedOutput(); });
+    ProcessSummary summary;
+    std::string_view cmd_str;
+    while (summary.processed < max_commands && NextLine(cmd_str)) {
+      DispatchCounted(cmd_str, summary);
+    }
+    return summary;
+  }
 
- public:
-  explicit LineProtocol(int buf_reserve = 150, char delim = '\n', std::ostream& ostream = std::cout) : delim(delim),
-                                                                                                       ostream_(ostream) {
-    buf_.reserve(buf_reserve);
-  };
+  /// Dispatch a line of a batch and record its failure in the summary.
+  void DispatchCounted(std::string_view line, ProcessSummary& summary) {
+    ++summary.processed;
+    bool ok;
+#ifdef __EXCEPTIONS
+    try {
+      ok = Dispatch(line);
+    } catch (const std::exception& e) {
+      if (summary.failed++ == 0) {
+        summary.first_error = e.what();
+      }
+      StoreDeferredInput();
+      return;
+    }
+#else
+    ok = Dispatch(line);
+#endif
+    if (!ok && summary.failed++ == 0) {
+      summary.first_error = std::string(line) + " failed";
+    }
+    // after the last use of the line, which can be in buf_
+    StoreDeferredInput();
+  }
 
  public:
-  void Feed(const char* buffer, size_t len) {
-    buf_.append(buffer, len);
+  bool RegisterCommand(const std::string& full_qualifier, const ArgumentMap& arg_map, const CommandCallback& callback) {
+    return AddCommand(full_qualifier, arg_map, callback);
   }
-  void Feed(const std::string& str) {
-    buf_.append(str);
+  /// The handler gets a CommandArguments view with the exact values instead of the two maps of a CommandCallback.
+  bool RegisterCommand(const std::string& full_qualifier, const ArgumentMap& arg_map, const CommandHandler& handler) {
+    return AddCommand(full_qualifier, arg_map, handler);
   }
-  const std::string& GetBuffer() const {
-    return buf_;
+  /// An asynchronous command, see CompletionToken. A handler that throws or calls RejectCommand before it returns
+  /// fails the command like a synchronous one.
+  bool RegisterCommand(const std::string& full_qualifier, const ArgumentMap& arg_map, const AsyncCommandHandler& handler) {
+    return AddCommand(full_qualifier, arg_map, handler);
   }
-  void SetOStream(std::ostream& ostream) {
-    ostream_ = ostream;
+  bool RegisterCommand(const std::string& full_qualifier, const ArgumentMap& arg_map, std::nullptr_t) {
+    return AddCommand(full_qualifier, arg_map, CommandCallback(nullptr));
+  }
+  /// Register a table of commands with one reservation of the registry. Without exceptions, it stops at the first
+  /// command that fails and returns false; the commands before it stay registered.
+  bool RegisterCommands(std::initializer_list<CommandDefinition> commands) {
+    return RegisterCommands(commands.begin(), commands.size());
+  }
+  /// Register the n commands of a table, e.g. a static const array defined at boot:
+  /// `RegisterCommands(kCommands, std::size(kCommands))`. The table is only read during the call; the qualifiers,
+  /// arguments and handlers are copied into the registry.
+  bool RegisterCommands(const CommandDefinition* commands, size_t n) {
+    registry_->ReserveMap(registry_->command_map_, registry_->command_map_.size() + n);
+    for (size_t i = 0; i < n; ++i) {
+      if (!AddCommand(commands[i].qualifier, commands[i].args, commands[i].handler)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  /// Register the states constructed with DeferRegistration, with one reservation of the registry.
+  template <typename... States>
+  bool RegisterExchangeStates(States&... states) {
+    registry_->ReserveMap(registry_->exchange_state_map_, registry_->exchange_state_map_.size() + sizeof...(States));
+    return (states.Register() && ...);
   }
 
- public:
-  bool ValidateApply(const std::string& cmd_line) {
-    size_t last = cmd_line.find_first_not_of(' ');
-    size_t next = 0;
-    std::vector<std::string> tokens;
-    while ((next = cmd_line.find(' ', last)) != std::string::npos) {
-      tokens.push_back(cmd_line.substr(last, next - last));
-      last = cmd_line.find_first_not_of(' ', next);
+ private:
+  template <typename Arguments, typename Callback>
+  bool AddCommand(std::string_view full_qualifier, const Arguments& args, const Callback& callback) {
+    if (args.size() > CommandSpec::kMaxArguments) {
+      FLP_THROW(InvalidArgumentError, std::string(full_qualifier) + " has too many arguments");
     }
-    // if no more non-space, no need for the extra token (tailing space)
-    if (last != std::string::npos) {
-      auto last_token = cmd_line.substr(last);
-      if (!last_token.empty()) {
-        tokens.push_back(last_token);
-      }
+    // the qualifier takes one token of the line
+    if (static_cast<size_t>(std::count_if(args.begin(), args.end(), [](const auto& item) { return !item.second.optional; }))
+        > MaxTokens() - 1) {
+      FLP_THROW(InvalidArgumentError, std::string(full_qualifier) + " has too many required arguments");
     }
-    auto qualifier_str = tokens[0];
-    // check if the qualifier is valid
-    auto found = command_map_.find(qualifier_str);
-    if (found == command_map_.end()) {
-      FLP_THROW(UnknownQualifierError, "Unknown qualifier");
+    // one lookup: the spec is only dropped again if the qualifier is taken
+    auto [it, inserted] = registry_->command_map_.try_emplace(Key(full_qualifier), args, callback);
+    if (!inserted) {
+      FLP_THROW(InvalidArgumentError, std::string(full_qualifier) + " is already registered");
     }
+    auto* node = registry_->command_trie_.Insert(full_qualifier);
+    if (!node) {
+      registry_->command_map_.erase(it);
+      FLP_THROW(InvalidArgumentError, std::string(full_qualifier) + " is in a mounted namespace");
+    }
+    node->qualifier = it->second.qualifier = it->first;
+    node->spec = &it->second;
+    CommandsChanged();
+    return true;
+  }
+  /// Invalidate what is derived from the registration.
+  void CommandsChanged() {
+    // the compiled table no longer matches the registration
+    Unfreeze();
+    registry_->schema_dirty_ = true;
+    registry_->cmd_reg_dirty_ = true;
+  }
+  bool EraseCommands(std::string_view qualifier, bool subtree) {
+    bool erased = registry_->command_trie_.Erase(qualifier, subtree, [this](std::string_view removed) {
+      registry_->ForEachSession([&](LineProtocol& session) { session.DropInflight(removed); });
+      registry_->command_map_.erase(Key(removed));
+    });
+    if (erased) {
+      CommandsChanged();
+    }
+    return erased;
+  }
 
-    // store the unmapped arguments
-    std::unordered_map<std::string, float> predefined_arg_map, undefined_arg_map;
-    auto command = found->second;
-    auto& arg_map = command.arg_map;
-    // check if the arguments are valid
-    for (int i = 1; i < tokens.size(); ++i) {
-      auto token = tokens[i];
-      // find '=' in the token
-      auto eq_pos = token.find('=');
-      if (eq_pos == std::string::npos) {
-        FLP_THROW(InvalidArgumentError, "Invalid argument: " + token);
-      }
-      auto arg_name = token.substr(0, eq_pos);
-      auto arg_value = token.substr(eq_pos + 1);
-
-      if (arg_value.empty()) {
-        // test arg=\n
-        FLP_THROW(InvalidArgumentError, token + " incomplete pair");
-      }
-
-      char* p;
-      auto int_val = strtol(arg_value.c_str(), &p, 10);
-      // if p points to the end of the string, conversion is successful
-      bool val_is_int = *p == 0;
+ public:
+  /// \return false if the command is not registered.
+  bool UnregisterCommand(std::string_view full_qualifier) {
+    return EraseCommands(full_qualifier, false);
+  }
+  /// Remove the namespace `prefix`: every command and mount whose qualifier starts with `prefix.`, and the command
+  /// `prefix` itself. For example "motor" removes motor.set and motor.pid.kp.
+  /// \return false if nothing was registered there.
+  bool UnregisterCommands(std::string_view prefix) {
+    return EraseCommands(prefix, true);
+  }
+  /// Delegate the namespace `prefix` to a child: a line `prefix.rest args...` is dispatched as `rest args...` by the
+  /// child, whose callbacks and responses handle it. The child must outlive the mount. Its commands are not part of the
+  /// registry and the binary schema of this LineProtocol.
+  bool Mount(std::string_view prefix, LineProtocol& child) {
+    // check the collision first, so a failed mount leaves no nodes behind
+    auto* existing = registry_->command_trie_.FindNode(prefix);
+    if (existing && (existing->delegate || !existing->children.empty())) {
+      FLP_THROW(InvalidArgumentError, std::string(prefix) + " is already in use");
+    }
+    auto* node = registry_->command_trie_.Insert(prefix);
+    if (!node) {
+      FLP_THROW(InvalidArgumentError, std::string(prefix) + " is already in use");
+    }
+    node->delegate = &child;
+    return true;
+  }
 
-      auto float_val = strtof(arg_value.c_str(), &p);
-      // if p points to the end of the string, conversion is successful
-      bool val_is_float = *p == 0;
+  /// Compile the registered commands into a flat lookup table used by the dispatch. Call it once the registration is
+  /// done. Registering another command or state drops the table until Freeze is called again.
+  void Freeze() {
+    registry_->compiled_commands_.Build(registry_->command_map_);
+    registry_->frozen_ = true;
+    // built now, so the registry is not written while the sessions dispatch
+    GetBinarySchema();
+    GetRegistryDocument();
+  }
+  void Unfreeze() {
+    registry_->compiled_commands_.Clear();
+    registry_->frozen_ = false;
+  }
+  [[nodiscard]] bool IsFrozen() const { return registry_->frozen_; }
 
-      if (!val_is_float) {
-        // float val is used throughout the next steps. If it is not valid, use the one from int.
-        float_val = (float)int_val;
-      }
+  /// Dispatch the commands of a StaticCommandTable before looking up the runtime registration.
+  template <typename Table>
+  void UseStaticCommands() {
+    registry_->static_dispatch_ = &Table::Dispatch;
+  }
 
-      if (!(val_is_int || val_is_float)) {
-        FLP_THROW(InvalidArgumentError, token + " value is not numeric");
-      }
+  template <typename T>
+  bool RegisterExchangeState(ExchangeState<T>& es);
 
-      // check if the arg_name exists
-      auto found_arg = arg_map.find(arg_name);
-      if (found_arg == arg_map.end()) {
-        // non existing arg
-        undefined_arg_map[arg_name] = float_val;
-      } else {
-        // existing in the spec
+  void UnregisterExchangeState(const std::string& name) {
+    registry_->exchange_state_map_.erase(Key(name));
+    StatesChanged();
+  }
+  /// Invalidate the binary schema. The registry is no longer frozen, so the schema is not rebuilt while the sessions
+  /// dispatch from it.
+  void StatesChanged() {
+    Unfreeze();
+    registry_->schema_dirty_ = true;
+  }
 
-        // should be int but a float is given, error.
-        if (!found_arg->second.is_float && !val_is_int) {
-          FLP_THROW(InvalidArgumentError, token + "  should be int");
-        }
+ public:
+  /// Switch the input and the output between the text lines and the COBS framed binary messages.
+  void SetBinaryMode(bool enable) {
+    binary_mode_ = enable;
+    FindLineBegin();
+  }
+  [[nodiscard]] bool IsBinaryMode() const { return binary_mode_; }
 
-        auto validator = found_arg->second.validator;
-
-        if (!validator) {
-          // if validator is not set, just set the value
-          predefined_arg_map[arg_name] = float_val;
-        } else {
-          // validator was set, it should return true if valid.
-          if (!validator(float_val)) {
-            FLP_THROW(ValidatorError, token + " validation failed");
-          } else {
-            predefined_arg_map[arg_name] = float_val;
-          }
-        }
+  /// The ids change when a command or a state is registered or unregistered.
+  const BinarySchema& GetBinarySchema() {
+    if (!registry_->schema_dirty_) {
+      return registry_->binary_schema_;
+    }
+    auto by_name = [](const auto& a, const auto& b) { return a.first < b.first; };
+    registry_->binary_schema_.commands.clear();
+    for (auto& item : registry_->command_map_) {
+      BinarySchema::Command command{item.first, &item.second, {}};
+      // the argument ids are the slots
+      command.args.resize(item.second.arg_map.size());
+      for (auto& arg : item.second.arg_map) {
+        command.args[arg.second.slot] = {arg.first, &arg.second};
       }
+      registry_->binary_schema_.commands.push_back(std::move(command));
     }
-
-    // check if all required arguments are supplied
-    for (auto& item : arg_map) {
-      if (!item.second.optional) {
-        if (predefined_arg_map.find(item.first) == predefined_arg_map.end()) {
-          FLP_THROW(InvalidArgumentError, item.first + " is required");
-        }
+    std::sort(registry_->binary_schema_.commands.begin(), registry_->binary_schema_.commands.end(), [](const auto& a, const auto& b) { return a.qualifier < b.qualifier; });
+    registry_->binary_schema_.states.clear();
+    for (auto& item : registry_->exchange_state_map_) {
+      registry_->binary_schema_.states.emplace_back(item.first, &item.second);
+    }
+    std::sort(registry_->binary_schema_.states.begin(), registry_->binary_schema_.states.end(), by_name);
+    for (size_t i = 0; i < registry_->binary_schema_.states.size(); ++i) {
+      if (auto* state = registry_->binary_schema_.states[i].second->state) {
+        state->binary_id_ = static_cast<uint16_t>(i);
       }
     }
-
-    // All check has passed, now apply the arguments.
-    // TODO: cache the previous arguments for transaction rollback
-    for (auto& item : predefined_arg_map) {
-      arg_map.at(item.first).setter(item.second);
+    registry_->schema_dirty_ = false;
+    return registry_->binary_schema_;
+  }
+  /// The document of @flp.cmd_reg: the arguments of each command, in the order of the binary schema.
+  const std::pmr::string& GetRegistryDocument() {
+    if (!registry_->cmd_reg_dirty_) {
+      return registry_->cmd_reg_cache_;
     }
-
-    // Invoke the callback, which can be nullptr.
-    if (command.callback) {
-      command.callback(predefined_arg_map, undefined_arg_map);
+    auto& commands = GetBinarySchema().commands;
+    auto& reg = registry_->cmd_reg_cache_;
+    reg = "{";
+    for (size_t i = 0; i < commands.size(); ++i) {
+      reg.append(i ? ",\"" : "\"").append(commands[i].qualifier).append("\": {");
+      auto& args = commands[i].args;
+      for (size_t j = 0; j < args.size(); ++j) {
+        reg.append(j ? ",\"" : "\"").append(args[j].name).append("\":\"");
+        reg.append(args[j].spec->optional ? "optional," : "required,");
+        reg.append(args[j].spec->is_float ? "float\"" : "int\"");
+      }
+      reg.append("}");
     }
-    return true;
+    reg.append("}");
+    registry_->cmd_reg_dirty_ = false;
+    return reg;
   }
 
  public:
-  /// Process will only process one valid command once.
-  /// However, if there are consecutive CR, they will be purged.
-  /// \return
-  bool Process() {
-    while (true) {
-      // check if there is a delim in the buffer
-      auto found = buf_.find(delim);
-      if (found == std::string::npos) {
-        // no delim
-        return false;
-      }
-
-      auto cmd_str = buf_.substr(0, found);
-      buf_.erase(0, found + 1);
+  /// \param interval minimum time between two flushes by Tick, in the unit of the timestamp source.
+  void SetReportMode(ReportMode mode, int64_t interval = 0) {
+    if (report_mode_ == ReportMode::kCoalesced && mode == ReportMode::kImmediate) {
+      FlushStates();
+    }
+    report_mode_ = mode;
+    report_interval_ = interval;
+  }
+  [[nodiscard]] ReportMode GetReportMode() const { return report_mode_; }
 
-      if (cmd_str.empty() || cmd_str.find_first_not_of(' ') == std::string::npos) {
-        // ignore multiple \n\n\n or \n[space]\n
+  /// Called by ExchangeState::Set when the state should be reported.
+  void ScheduleReport(ExchangeStateBase& state) {
+    // the dirty list belongs to the loop thread
+    if (report_mode_ == ReportMode::kImmediate || !OnLoopThread()) {
+      state.ReportState();
+    } else if (!state.dirty_) {
+      state.dirty_ = true;
+      dirty_states_.push_back(&state);
+    }
+  }
+  void CountSuppressedReport() {
+#if FLP_ENABLE_STATS
+    if (OnLoopThread()) {
+      ++stats_.reports_suppressed;
+    }
+#endif
+  }
+  /// Called by ExchangeState::Set when the value has changed.
+  void CountChange(ExchangeStateBase& state) {
+    state.seq_ = ++registry_->state_seq_;
+  }
+  /// \return whether a session of the registry receives the reports of the state.
+  [[nodiscard]] bool HasSubscribers(const ExchangeStateBase& state) const {
+    return state.subscribers_ != 0 || registry_->unmasked_sessions_ != 0;
+  }
+  /// \return whether this session receives the reports of the state, see Subscribe.
+  [[nodiscard]] bool IsSubscribed(const ExchangeStateBase& state) const {
+    return !subscriber_bit_ || (state.subscribers_ & subscriber_bit_);
+  }
+  /// Add or remove this session to the subscribers of the states that match one of the patterns: a name, or a prefix
+  /// followed by '*'. "*" or no pattern selects all the states, including those registered later. A session receives
+  /// all the states until its first call: a first subscription to some states narrows the reports to those states.
+  /// The sessions beyond the 32nd of a registry always receive all of them, and nothing changes for them.
+  /// \return number of the states whose subscription changed or was confirmed, 0 for a session beyond the 32nd.
+  size_t Subscribe(const std::vector<std::string_view>& patterns, bool subscribe) {
+    if (!subscriber_bit_) {
+      return 0;
+    }
+    auto matches = [](std::string_view name, std::string_view pattern) {
+      if (!pattern.empty() && pattern.back() == '*') {
+        pattern.remove_suffix(1);
+        return name.substr(0, pattern.size()) == pattern;
+      }
+      return name == pattern;
+    };
+    bool all = patterns.empty() || std::find(patterns.begin(), patterns.end(), "*") != patterns.end();
+    if (!subscriptions_set_ && subscribe && !all) {
+      // the session received every state so far, now it receives only the named ones
+      registry_->default_subscribers_ &= ~subscriber_bit_;
+      for (auto& item : registry_->exchange_state_map_) {
+        if (item.second.state) {
+          item.second.state->subscribers_ &= ~subscriber_bit_;
+        }
+      }
+    }
+    subscriptions_set_ = true;
+    if (all && subscribe) {
+      registry_->default_subscribers_ |= subscriber_bit_;
+    } else if (all) {
+      registry_->default_subscribers_ &= ~subscriber_bit_;
+    }
+    size_t matched = 0;
+    for (auto& item : registry_->exchange_state_map_) {
+      bool selected = all;
+      for (auto pattern : patterns) {
+        selected = selected || matches(item.first, pattern);
+      }
+      if (!selected || !item.second.state) {
         continue;
       }
-      return ValidateApply(cmd_str);
+      ++matched;
+      if (subscribe) {
+        item.second.state->subscribers_ |= subscriber_bit_;
+      } else {
+        item.second.state->subscribers_ &= ~subscriber_bit_;
+      }
     }
+    return matched;
   }
-
- public:
-  bool RegisterCommand(const std::string& full_qualifier, const ArgumentMap& arg_map, const CommandCallback& callback) {
-    if (command_map_.find(full_qualifier) == command_map_.end()) {
-      command_map_.try_emplace(full_qualifier, arg_map, callback);
-      return true;
-    } else {
-      FLP_THROW(InvalidArgumentError, full_qualifier + " is already registered");
+  /// \return the sequence number of the latest change of any state.
+  [[nodiscard]] uint32_t GetStateSequence() const { return registry_->state_seq_; }
+  /// Drop a pending coalesced report.
+  void CancelReport(ExchangeStateBase& state) {
+    if (state.dirty_) {
+      state.dirty_ = false;
+      dirty_states_.erase(std::find(dirty_states_.begin(), dirty_states_.end(), &state));
     }
   }
-
-  template <typename T>
-  bool RegisterExchangeState(ExchangeState<T>& es);
-
-  void UnregisterExchangeState(const std::string& name) {
-    exchange_state_map_.erase(name);
+  /// Report the dirty states whose values changed since their last report.
+  void FlushStates() {
+    TimestampBatch timestamps(*this);
+    // a report may set other states
+    for (size_t i = 0; i < dirty_states_.size(); ++i) {
+      auto* state = dirty_states_[i];
+      state->dirty_ = false;
+      if (state->IsReportDue(true)) {
+        state->ReportState();
+      } else {
+        CountSuppressedReport();
+      }
+    }
+    dirty_states_.clear();
+    last_flush_ = Timestamp();
+    DrainQueuedOutput();
+  }
+  /// Call it from the main loop in the coalesced mode, with the output queue or with the buffered output. The dirty
+  /// states are flushed if the report interval has passed, then the queued and buffered output is written.
+  void Tick() {
+    if (report_mode_ == ReportMode::kCoalesced && !dirty_states_.empty()) {
+      // the flush reuses this clock read
+      TimestampBatch timestamps(*this);
+      if (Timestamp() - last_flush_ >= report_interval_) {
+        FlushStates();
+      }
+    }
+    DrainQueuedOutput();
+    FlushOutput();
   }
 
   void RegisterInternalCommands() {
     RegisterCommand("@flp.version",
                     {},
-                    [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
-                      Respond("@flp.version", FLP_VERSION, '_');
+                    [](const CommandArguments&) {
+                      auto& session = *DispatchingSession();
+                      session.Respond("@flp.version", FLP_VERSION, '_');
                     });
     RegisterCommand("@flp.buffer.size",
                     {},
-                    [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
-                      Respond("@flp.buffer.size", std::to_string(buf_.size()), '_');
+                    [](const CommandArguments&) {
+                      auto& session = *DispatchingSession();
+                      session.Respond("@flp.buffer.size", std::to_string(session.buf_.size() - session.head_), '_');
+                    });
+#if FLP_ENABLE_STATS
+    // The totals, then one response per command that has been processed. The histograms list the bucket counts of
+    // TimeHistogram.
+    RegisterCommand("@flp.stats",
+                    {{"reset", SessionArgument(&LineProtocol::stats_reset_arg_, true, [](double v) { return v == 0 || v == 1; })}},
+                    [](const CommandArguments& args) {
+                      auto& session = *DispatchingSession();
+                      auto write_histogram = [](ResponseWriter& writer, const TimeHistogram& histogram) {
+                        for (size_t i = 0; i < histogram.buckets.size(); ++i) {
+                          if (i) {
+                            writer.Write(',');
+                          }
+                          writer.WriteValue(histogram.buckets[i]);
+                        }
+                      };
+                      {
+                        auto writer = session.BeginResponse("@flp.stats", '_');
+                        writer.Write("processed=");
+                        writer.WriteValue(session.stats_.commands.processed);
+                        writer.Write(" failed=");
+                        writer.WriteValue(session.stats_.commands.failed);
+                        writer.Write(" bytes_in=");
+                        writer.WriteValue(session.stats_.bytes_in);
+                        writer.Write(" bytes_out=");
+                        writer.WriteValue(session.stats_.bytes_out);
+                        writer.Write(" high_water=");
+                        writer.WriteValue(session.stats_.buffer_high_water);
+                        writer.Write(" reports=");
+                        writer.WriteValue(session.stats_.reports_emitted);
+                        writer.Write(" suppressed=");
+                        writer.WriteValue(session.stats_.reports_suppressed);
+                        writer.Write(" parse_ns=");
+                        write_histogram(writer, session.stats_.parse_time);
+                        writer.Write(" dispatch_ns=");
+                        write_histogram(writer, session.stats_.dispatch_time);
+                        writer.End();
+                      }
+                      for (auto& item : session.registry_->command_map_) {
+                        auto& stats = item.second.stats;
+                        if (stats.processed == 0) {
+                          continue;
+                        }
+                        auto writer = session.BeginResponse("@flp.stats", '_');
+                        writer.Write(item.first);
+                        writer.Write(" processed=");
+                        writer.WriteValue(stats.processed);
+                        writer.Write(" failed=");
+                        writer.WriteValue(stats.failed);
+                        writer.End();
+                      }
+                      if (args.Get<int>("reset") != 0) {
+                        session.ResetStats();
+                      }
+                    });
+#endif
+    RegisterCommand("@flp.binary",
+                    {{"enable", SessionArgument(&LineProtocol::binary_enable_arg_, true, [](double v) { return v == 0 || v == 1; })}},
+                    [](const CommandArguments& args) {
+                      auto& session = *DispatchingSession();
+                      bool enable = args.Get<int>("enable", 1) != 0;
+                      // the response is sent in the current mode
+                      session.Respond("@flp.binary", "OK", '_');
+                      session.SetBinaryMode(enable);
+                    });
+    RegisterCommand("@flp.binary.schema",
+                    {},
+                    [](const CommandArguments&) {
+                      auto& session = *DispatchingSession();
+                      auto& schema = session.GetBinarySchema();
+                      std::string reg = "{\"commands\":{";
+                      for (size_t i = 0; i < schema.commands.size(); ++i) {
+                        auto& command = schema.commands[i];
+                        reg += (i ? ",\"" : "\"") + std::string(command.qualifier) + "\":{\"id\":" + std::to_string(i) + ",\"args\":{";
+                        for (size_t j = 0; j < command.args.size(); ++j) {
+                          reg += (j ? ",\"" : "\"") + std::string(command.args[j].name) + "\":" + std::to_string(j);
+                        }
+                        reg += "}}";
+                      }
+                      reg += "},\"states\":{";
+                      for (size_t i = 0; i < schema.states.size(); ++i) {
+                        reg += (i ? ",\"" : "\"") + std::string(schema.states[i].first) + "\":" + std::to_string(i);
+                      }
+                      reg += "}}";
+                      session.Respond("@flp.binary.schema", reg, '_');
                     });
     RegisterCommand("@flp.cmd_reg",
                     {},
-                    [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
-                      std::string reg = "{";
-                      for (auto it = command_map_.begin(); it != command_map_.end(); ++it) {
-                        reg += "\"" + it->first + "\": {";
-                        auto& arg_map = it->second.arg_map;
-                        for (auto arg_it = arg_map.begin(); arg_it != arg_map.end(); ++arg_it) {
-                          reg += "\"" + arg_it->first + "\":\""
-                              + (arg_it->second.optional ? "optional," : "required,")
-                              + (arg_it->second.is_float ? "float" : "int") + "\"";
-                          if (std::next(arg_it) != arg_map.end()) {
-                            reg += ",";
-                          }
+                    [](const CommandArguments&) {
+                      auto& session = *DispatchingSession();
+                      session.Respond("@flp.cmd_reg", session.GetRegistryDocument(), '_');
+                    });
+
+    // @flp.inflight: the asynchronous commands of the calling session that have not completed yet, in the order of
+    // dispatch, e.g. [{"id":3,"command":"motor.home","age":120}]. The age is in the unit of the timestamps.
+    RegisterCommand("@flp.inflight",
+                    {},
+                    [](const CommandArguments&) {
+                      auto& session = *DispatchingSession();
+                      auto now = session.Timestamp();
+                      auto writer = session.BeginResponse("@flp.inflight", '_');
+                      writer.Write('[');
+                      {
+#if FLP_ENABLE_CONCURRENCY
+                        std::lock_guard<std::mutex> lock(session.inflight_mutex_);
+#endif
+                        for (size_t i = 0; i < session.n_inflight_; ++i) {
+                          auto& command = session.inflight_[i];
+                          writer.Write(i ? ",{\"id\":" : "{\"id\":");
+                          writer.WriteValue(command.id);
+                          writer.Write(",\"command\":\"");
+                          writer.Write(command.qualifier);
+                          writer.Write("\",\"age\":");
+                          writer.WriteValue(now - command.started);
+                          writer.Write('}');
                         }
-                        reg += (std::next(it) == command_map_.end() ? "}" : "},");
                       }
-                      reg += "}";
-                      Respond("@flp.cmd_reg", reg, '_');
+                      writer.Write(']');
+                      writer.End();
                     });
 
+    // @flp.subscribe [<pattern>=1 ...] and @flp.unsubscribe [<pattern>=1 ...]: a pattern is a state name or a prefix
+    // followed by '*', no pattern selects all states. The first @flp.subscribe of a session with a pattern limits the
+    // reports to the matched states. The response is the number of the matched states, always 0 for a session beyond
+    // the 32nd of the registry, which receives every state.
+    for (bool subscribe : {true, false}) {
+      auto qualifier = subscribe ? "@flp.subscribe" : "@flp.unsubscribe";
+      RegisterCommand(qualifier,
+                      {},
+                      [subscribe, qualifier](const CommandArguments& args) {
+                        auto& session = *DispatchingSession();
+                        std::vector<std::string_view> patterns;
+                        for (auto& arg : args) {
+                          if (!arg.IsPredefined()) {
+                            patterns.push_back(arg.name);
+                          }
+                        }
+                        session.Respond(qualifier, std::to_string(session.Subscribe(patterns, subscribe)), '_');
+                      });
+    }
+
+    // @flp.state [offset=n] [limit=n] [<prefix>=1 ...]: the states sorted by name, streamed to the sink. Any other
+    // argument name is a prefix, and only the states that start with one of the prefixes are listed. The offset and
+    // limit apply to the listed states, limit=0 lists all of them.
+    auto non_negative = [](double v) { return v >= 0; };
     RegisterCommand("@flp.state",
-                    {},
-                    [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
-                      std::string reg = "{";
-                      for (auto it = exchange_state_map_.begin(); it != exchange_state_map_.end(); ++it) {
-                        float getter = it->second.getter();
-                        reg += "\"" + it->first + "\":"
-                            + (it->second.is_float ? std::to_string(getter) : std::to_string((int)getter));
-                        if (std::next(it) != exchange_state_map_.end()) {
-                          reg += ",";
+                    {{"offset", SessionArgument(&LineProtocol::state_offset_arg_, true, non_negative)},
+                     {"limit", SessionArgument(&LineProtocol::state_limit_arg_, true, non_negative)}},
+                    [](const CommandArguments& args) {
+                      auto& session = *DispatchingSession();
+                      // unlike the usual arguments, the paging does not persist between the requests
+                      auto offset = args.Get<size_t>("offset");
+                      auto limit = args.Get<size_t>("limit");
+                      bool any_prefix = std::any_of(args.begin(), args.end(), [](auto& arg) { return !arg.IsPredefined(); });
+                      auto writer = session.BeginResponse("@flp.state", '_');
+                      writer.Write('{');
+                      size_t index = 0, listed = 0;
+                      for (auto& [name, state] : session.GetBinarySchema().states) {
+                        if (limit && listed == limit) {
+                          break;
+                        }
+                        bool selected = !any_prefix;
+                        for (auto& prefix : args) {
+                          selected = selected || (!prefix.IsPredefined() && name.substr(0, prefix.name.size()) == prefix.name);
+                        }
+                        if (!selected || index++ < offset) {
+                          continue;
                         }
+                        writer.Write(listed++ ? ",\"" : "\"");
+                        writer.Write(name);
+                        writer.Write("\":");
+                        WriteStateValue(writer, *state);
                       }
-                      reg += "}";
-                      Respond("@flp.state", reg, '_');
+                      writer.Write('}');
+                      writer.End();
+                    });
+
+    // @flp.state.since seq=n: the current sequence number followed by name=value of every state that changed after
+    // the sequence number n, e.g. "seq=42 motor.speed=1200 enabled=1". A host that stores the sequence number of the
+    // previous sync only receives the changes. seq=0 returns all states.
+    RegisterCommand("@flp.state.since",
+                    {{"seq", SessionArgument(&LineProtocol::state_since_arg_, false)}},
+                    [](const CommandArguments&) {
+                      auto& session = *DispatchingSession();
+                      uint32_t since = session.state_since_arg_;
+                      auto writer = session.BeginResponse("@flp.state.since", '_');
+                      writer.Write("seq=");
+                      writer.WriteValue(static_cast<uint32_t>(session.registry_->state_seq_));
+                      for (auto& [name, state] : session.GetBinarySchema().states) {
+                        // modular comparison, the sequence numbers wrap around
+                        if (!state->state || static_cast<int32_t>(state->state->GetSequence() - since) <= 0) {
+                          continue;
+                        }
+                        writer.Write(' ');
+                        writer.Write(name);
+                        writer.Write('=');
+                        WriteStateValue(writer, *state);
+                      }
+                      writer.End();
                     });
   }
 
  public:
-  void Respond(const std::string& channel, const std::string& message, char label = 'R') {
-    ostream_.get() << label << "(" << FLP_TIMESTAMP << ") "
-                   << channel << ": " << message << "\n";
+  void Respond(std::string_view channel, std::string_view message, char label = 'R') {
+    auto writer = BeginResponse(channel, label);
+    writer.Write(message);
+    writer.End();
+  }
+
+  /// Write the header of a response. The caller writes the message and calls End.
+  /// In the binary mode, the frame is the label (u8), the timestamp (u32), 0 (u8), the channel prefixed by its
+  /// length (u8) and the message.
+  ResponseWriter BeginResponse(std::string_view channel, char label = 'R') {
+    auto writer = MakeWriter(binary_mode_);
+    if (writer.IsBinary()) {
+      channel = channel.substr(0, 255);
+      writer.Write(label);
+      writer.WriteLE(static_cast<uint32_t>(Timestamp()));
+      writer.Write('\0');
+      writer.Write(static_cast<char>(channel.size()));
+      writer.Write(channel);
+      return writer;
+    }
+    writer.Write(label);
+    writer.Write('(');
+    writer.WriteValue(Timestamp());
+    writer.Write(") ");
+    writer.Write(channel);
+    writer.Write(": ");
+    return writer;
+  }
+
+  /// Write the header of a state report. The caller writes the value and calls End.
+  /// In the binary mode, the frame is 'R' (u8), the timestamp (u32), 1 (u8), the state id (u16) and the tagged value.
+  ResponseWriter BeginStateReport(ExchangeStateBase& state, std::string_view name) {
+#if FLP_ENABLE_STATS
+    if (OnLoopThread()) {
+      ++stats_.reports_emitted;
+    }
+#endif
+    if (!binary_mode_) {
+      return BeginResponse(name, 'R');
+    }
+    if (OnLoopThread()) {
+      // refresh the ids
+      GetBinarySchema();
+    }
+    auto writer = MakeWriter(true);
+    writer.Write('R');
+    writer.WriteLE(static_cast<uint32_t>(Timestamp()));
+    writer.Write('\1');
+    writer.WriteLE(state.binary_id_);
+    return writer;
   }
 };
 
 // Method implementations
+inline bool CompletionToken::Complete(std::string_view message) {
+  if (!session_) {
+    return false;
+  }
+  assert(session_->CanWriteFromThisThread() && "a token completed on another thread needs an output queue");
+  if (!session_->CanWriteFromThisThread()) {
+    return false;
+  }
+  std::string_view qualifier;
+  if (!session_->EndInflight(id_, &qualifier)) {
+    return false;
+  }
+  session_->Respond(qualifier, message, '_');
+  return true;
+}
+inline bool CompletionToken::Fail(std::string_view reason) {
+  if (!session_) {
+    return false;
+  }
+  assert(session_->CanWriteFromThisThread() && "a token completed on another thread needs an output queue");
+  if (!session_->CanWriteFromThisThread()) {
+    return false;
+  }
+  std::string_view qualifier;
+  if (!session_->EndInflight(id_, &qualifier)) {
+    return false;
+  }
+  session_->Respond(qualifier, reason, 'E');
+  return true;
+}
+
 template <typename T>
 ExchangeState<T>::ExchangeState(LineProtocol& flp, const std::string& name)
     : flp_(flp), name_(name) {
-  flp.RegisterExchangeState(*this);
+  Register();
 }
 
 template <typename T>
-void ExchangeState<T>::ReportState() {
-  std::stringstream ss;
-  if constexpr (std::is_same_v<T, uint8_t> || std::is_same_v<T, int8_t>) {
-    ss << (int)state_;
-  } else if constexpr (std::is_floating_point_v<T>) {
-    if (n_decimal >= 0) {
-      ss << std::fixed << std::setprecision(n_decimal);
-    }
-    ss << state_;
+bool ExchangeState<T>::Register() {
+  if (!registered_) {
+    registered_ = flp_.RegisterExchangeState(*this);
+  }
+  return registered_;
+}
+
+template <typename T>
+void ExchangeState<T>::Set(const T& other) {
+  T previous = Get();
+  state_ = other;
+  if (previous != other) {
+    flp_.CountChange(*this);
+  }
+  // nobody listens, do not even format the report
+  if (!report_state || !flp_.HasSubscribers(*this)) {
+    return;
+  }
+  if (IsReportDue(false)) {
+    flp_.ScheduleReport(*this);
   } else {
-    ss << state_;
+    flp_.CountSuppressedReport();
   }
-  flp_.Respond(name_, ss.str(), 'R');
+}
+
+template <typename T>
+void ExchangeState<T>::ReportState() {
+  T value = Get();
+  last_reported_ = value;
+  has_reported_ = true;
+  // every session of the registry receives the report
+  flp_.GetRegistry()->ForEachSession([&](LineProtocol& session) {
+    if (!session.IsSubscribed(*this)) {
+      return;
+    }
+    assert(session.CanWriteFromThisThread() && "a session on another thread needs an output queue for the reports");
+    if (!session.CanWriteFromThisThread()) {
+      return;
+    }
+    auto writer = session.BeginStateReport(*this, name_);
+    if (writer.IsBinary()) {
+      writer.WriteBinaryValue(value);
+    } else {
+      writer.WriteValue(value, n_decimal);
+    }
+    writer.End();
+  });
 }
 template <typename T>
 ExchangeState<T>::~ExchangeState() {
-  flp_.UnregisterExchangeState(name_);
+  flp_.CancelReport(*this);
+  if (registered_) {
+    flp_.UnregisterExchangeState(name_);
+  }
 }
 
 template <typename T>
 bool LineProtocol::RegisterExchangeState(ExchangeState<T>& es) {
   auto& name = es.GetName();
-  if (exchange_state_map_.find(name) == exchange_state_map_.end()) {
-    exchange_state_map_.try_emplace(name, es.Getter(), es.Setter(), std::is_floating_point_v<T>);
+  bool inserted = registry_->exchange_state_map_.try_emplace(Key(name),
+                                                             [&es]() { return NumericValue::Of(es.Get()); },
+                                                             [&es](const NumericValue& v) { es.Set(v.As<T>()); },
+                                                             std::is_floating_point_v<T>,
+                                                             &es)
+                      .second;
+  if (inserted) {
+    es.subscribers_ = static_cast<uint32_t>(registry_->default_subscribers_);
+    // a new state is reported to the hosts that sync from an earlier sequence number
+    CountChange(es);
+    StatesChanged();
+    // room for every state, so the coalesced reports do not allocate. It grows geometrically, a boot with hundreds
+    // of states does not reallocate for each of them.
+    auto n_states = registry_->exchange_state_map_.size();
+    if (dirty_states_.capacity() < n_states) {
+      dirty_states_.reserve(std::max(n_states, 2 * dirty_states_.capacity()));
+    }
     return true;
   } else {
     FLP_THROW(InvalidArgumentError, name + " is already registered");
@@ -417,30 +4073,19 @@ bool LineProtocol::RegisterExchangeState(ExchangeState<T>& es) {
 }
 
 template <typename T>
-std::function<bool(float)>& get_default_validator() {
-  if constexpr (std::is_same_v<T, bool>) {
-    static std::function<bool(float)> validator = [](float v) {
-      return (v == 0 || v == 1);
-    };
-    return validator;
-  } else if constexpr (std::is_integral_v<T>) {
-    static std::function<bool(float)> validator = [](float v) {
-      return (v >= std::numeric_limits<T>::min() && v <= std::numeric_limits<T>::max());
-    };
-    return validator;
-  } else {
-    static std::function<bool(float)> validator = [](float v) {
-      return true;
-    };
-    return validator;
-  }
+Validator& get_default_validator() {
+  static Validator validator = [](double v) {
+    return IsInDefaultRange<T>(v);
+  };
+  return validator;
 }
 
 template <typename T>
-ArgumentSpec::ArgumentSpec(ExchangeState<T>& assign_to, bool optional, const std::function<bool(float)>& validator)
+ArgumentSpec::ArgumentSpec(ExchangeState<T>& assign_to, bool optional, const Validator& validator)
     : optional(optional),
       is_float(std::is_floating_point_v<T>),
-      setter(assign_to.Setter()),
+      setter([&assign_to](const NumericValue& v) { assign_to.Set(v.As<T>()); }),
+      getter([&assign_to]() { return NumericValue::Of(assign_to.Get()); }),
       validator(validator ? validator : get_default_validator<T>()) {}
 
 }  // namespace finix
\ No newline at end of file
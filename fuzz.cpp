@@ -0,0 +1,185 @@
+// Fuzz and stress harness of the input path under ProcessLimits, see the Real-time section of the Readme.
+// Every input is fed in chunks to a LineProtocol and processed one Process call at a time. The harness fails when a
+// single Feed, Process or ProcessBuffer call takes longer than the deadline, or when the pending input outgrows the
+// bound of the limits. The stress cases run several times and keep the run with the best worst call, so a preemption
+// of the process does not count as the cost of the call.
+//
+// Built with FLP_LIBFUZZER, LLVMFuzzerTestOneInput is the libFuzzer entry and the deadline in microseconds is read from
+// the environment variable FLP_FUZZ_MAX_US. Otherwise main runs the stress cases below:
+//
+//   flp_stress [--max-us N]
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "flp.h"
+using namespace finix;
+
+namespace {
+constexpr ProcessLimits kLimits{256, 8, 4096};
+// the largest chunk given to Feed or ProcessBuffer
+constexpr size_t kMaxChunk = 4096;
+
+double max_call_ns = 1e6;
+
+struct Worst {
+  double call_ns{0};
+  size_t pending_bytes{0};
+  size_t calls{0};
+};
+
+void Fail(const char* what, const Worst& worst) {
+  std::fprintf(stderr, "%s: worst call %.0f ns, %zu pending bytes\n", what, worst.call_ns, worst.pending_bytes);
+  std::abort();
+}
+
+template <typename F>
+void Timed(Worst& worst, F&& call) {
+  auto begin = std::chrono::steady_clock::now();
+  try {
+    call();
+  } catch (const std::exception&) {
+    // malformed lines fail, the harness only looks at the cost
+  }
+  auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+  worst.call_ns = std::max(worst.call_ns, ns);
+  ++worst.calls;
+}
+
+/// Feed the input in chunks of chunk bytes, through ProcessBuffer if in_place, and process the complete lines one
+/// Process call at a time.
+Worst RunCase(const char* data, size_t len, size_t chunk, bool in_place) {
+  LineProtocol flp;
+  flp.SetOutputSink([](const char*, size_t) {});
+  flp.SetProcessLimits(kLimits);
+  int speed = 0;
+  float accel = 0;
+  flp.RegisterCommand("motor.set", {{"speed", ArgumentSpec(speed)}, {"accel", ArgumentSpec(accel)}}, nullptr);
+  flp.RegisterCommand("motor.stop", {}, [](const CommandArguments&) {});
+  Worst worst;
+  for (size_t pos = 0; pos < len; pos += chunk) {
+    auto n = std::min(chunk, len - pos);
+    if (in_place) {
+      Timed(worst, [&]() { flp.ProcessBuffer(data + pos, n, 1); });
+    } else {
+      Timed(worst, [&]() { flp.Feed(data + pos, n); });
+    }
+    // each call searches at most max_scan_bytes, so a long backlog takes several calls
+    while (flp.GetBuffer().find('\n') != std::string_view::npos) {
+      Timed(worst, [&]() { flp.Process(); });
+    }
+    // only the partial line is left, and it is discarded once it exceeds the limit
+    worst.pending_bytes = std::max(worst.pending_bytes, flp.GetBuffer().size());
+    if (flp.GetBuffer().size() > kLimits.max_line_length) {
+      Fail("partial line exceeds max_line_length", worst);
+    }
+  }
+  return worst;
+}
+
+void ReadDeadline(const char* value) {
+  if (value) {
+    max_call_ns = std::strtod(value, nullptr) * 1e3;
+  }
+}
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  static bool init = (ReadDeadline(std::getenv("FLP_FUZZ_MAX_US")), true);
+  (void)init;
+  if (size == 0) {
+    return 0;
+  }
+  // the first byte selects the chunk size and the input path
+  size_t chunk = 1 + data[0] % kMaxChunk;
+  bool in_place = data[0] & 0x80;
+  auto worst = RunCase(reinterpret_cast<const char*>(data) + 1, size - 1, chunk, in_place);
+  if (worst.call_ns > max_call_ns) {
+    Fail("deadline exceeded", worst);
+  }
+  return 0;
+}
+
+#ifndef FLP_LIBFUZZER
+namespace {
+constexpr int kRepeats = 5;
+
+std::string Repeat(const std::string& text, size_t bytes) {
+  std::string out;
+  while (out.size() < bytes) {
+    out += text;
+  }
+  return out;
+}
+
+/// Bytes of the protocol alphabet from a fixed seed, so the runs are comparable.
+std::string RandomInput(size_t bytes) {
+  const char alphabet[] = "motor.set speed=accel=stop 0123456789.-e\n\n=  \r@";
+  uint64_t state = 0x9E3779B97F4A7C15ull;
+  std::string out(bytes, ' ');
+  for (auto& c : out) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    c = alphabet[(state >> 33) % (sizeof(alphabet) - 1)];
+  }
+  return out;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--max-us") == 0 && i + 1 < argc) {
+      ReadDeadline(argv[++i]);
+    } else {
+      std::fprintf(stderr, "usage: %s [--max-us N]\n", argv[0]);
+      return 2;
+    }
+  }
+  const size_t kBytes = 1 << 20;
+  struct Case {
+    const char* name;
+    std::string input;
+  };
+  const Case cases[] = {
+      {"no delimiter", std::string(kBytes, 'a')},
+      {"one huge line", std::string(kBytes, 'a') + "\n"},
+      {"thousands of tokens", "motor.set" + Repeat(" speed=1", kBytes) + "\n"},
+      {"short tokens", Repeat("motor.set a a a a a a a a a a a a a a a a a a a a\n", kBytes)},
+      {"blank lines", Repeat("\n \n", kBytes)},
+      {"valid commands", Repeat("motor.set speed=1200 accel=3.5\nmotor.stop\n", kBytes)},
+      {"random", RandomInput(kBytes)},
+  };
+  std::printf("Deadline %.0f us, max_line_length %zu, max_tokens %zu, max_scan_bytes %zu\n\n", max_call_ns / 1e3,
+              kLimits.max_line_length, kLimits.max_tokens, kLimits.max_scan_bytes);
+  std::printf("| case | chunk | path | calls | worst ns | pending bytes |\n|---|---:|---|---:|---:|---:|\n");
+  int failed = 0;
+  for (auto& c : cases) {
+    for (size_t chunk : {size_t{1}, size_t{64}, kMaxChunk}) {
+      for (bool in_place : {false, true}) {
+        // byte by byte, the first 64 KiB are enough
+        auto len = chunk == 1 ? std::min(c.input.size(), size_t{1} << 16) : c.input.size();
+        auto worst = RunCase(c.input.data(), len, chunk, in_place);
+        for (int i = 1; i < kRepeats; ++i) {
+          auto run = RunCase(c.input.data(), len, chunk, in_place);
+          if (run.call_ns < worst.call_ns) {
+            worst = run;
+          }
+        }
+        bool late = worst.call_ns > max_call_ns;
+        failed += late;
+        std::printf("| %s | %zu | %s | %zu | %.0f%s | %zu |\n", c.name, chunk, in_place ? "ProcessBuffer" : "Feed",
+                    worst.calls, worst.call_ns, late ? " (late)" : "", worst.pending_bytes);
+      }
+    }
+  }
+  if (failed) {
+    std::fprintf(stderr, "%d cases exceeded the deadline\n", failed);
+    return 1;
+  }
+  return 0;
+}
+#endif
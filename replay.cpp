@@ -0,0 +1,179 @@
+// Replay of a capture written by CaptureLog::Save, see the Capture section of the Readme.
+// The input records are fed to a LineProtocol that has a stub command for every qualifier of the capture, at the
+// original pace or as fast as possible, and the latency of each command is printed as a Markdown table.
+//
+//   flp_replay <capture> [--max-speed] [--tick-ns N]
+//
+// N is the length of a timestamp unit of the captured session in nanoseconds, 1000000 (1 ms) by default.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flp.h"
+using namespace finix;
+
+namespace {
+struct Latency {
+  size_t count{0};
+  size_t failed{0};
+  double total_ns{0};
+  double max_ns{0};
+};
+
+std::string_view NextToken(std::string_view& line) {
+  auto begin = line.find_first_not_of(" \r");
+  if (begin == std::string_view::npos) {
+    line = {};
+    return {};
+  }
+  auto end = line.find_first_of(" \r", begin);
+  auto token = line.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+  line = end == std::string_view::npos ? std::string_view() : line.substr(end);
+  return token;
+}
+
+/// Register a command that takes every argument name seen with its qualifier in the input. The values go to a
+/// scratch variable, so the replay measures the protocol and not the handlers of the device.
+void RegisterStubs(LineProtocol& flp, const std::string& input, double& scratch) {
+  std::map<std::string, std::set<std::string>> commands;
+  for (size_t pos = 0; pos < input.size();) {
+    auto end = input.find('\n', pos);
+    if (end == std::string::npos) {
+      end = input.size();
+    }
+    std::string_view line(input.data() + pos, end - pos);
+    pos = end + 1;
+    auto qualifier = NextToken(line);
+    if (qualifier.empty() || qualifier.front() == '@') {
+      continue;
+    }
+    auto& names = commands[std::string(qualifier)];
+    for (auto token = NextToken(line); !token.empty(); token = NextToken(line)) {
+      auto eq = token.find('=');
+      if (eq != std::string_view::npos && eq > 0) {
+        names.emplace(token.substr(0, eq));
+      }
+    }
+  }
+  for (auto& [qualifier, names] : commands) {
+    ArgumentMap arg_map;
+    for (auto& name : names) {
+      if (arg_map.size() == CommandSpec::kMaxArguments) {
+        break;
+      }
+      arg_map.try_emplace(name, scratch);
+    }
+    try {
+      flp.RegisterCommand(qualifier, arg_map, [](const CommandArguments&) {});
+    } catch (const std::exception& e) {
+      std::fprintf(stderr, "skipping %s: %s\n", qualifier.c_str(), e.what());
+    }
+  }
+}
+
+/// The qualifier of the next line in the buffer.
+std::string PeekQualifier(std::string_view buffer) {
+  auto begin = buffer.find_first_not_of(" \r\n");
+  if (begin == std::string_view::npos) {
+    return {};
+  }
+  auto line = buffer.substr(begin);
+  line = line.substr(0, line.find('\n'));
+  return std::string(NextToken(line));
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* path = nullptr;
+  bool max_speed = false;
+  double tick_ns = 1e6;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--max-speed") == 0) {
+      max_speed = true;
+    } else if (std::strcmp(argv[i], "--tick-ns") == 0 && i + 1 < argc) {
+      tick_ns = std::strtod(argv[++i], nullptr);
+    } else if (!path && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (!path) {
+    std::fprintf(stderr, "usage: %s <capture> [--max-speed] [--tick-ns N]\n", argv[0]);
+    return 2;
+  }
+  std::ifstream file(path, std::ios::binary);
+  std::string capture((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::vector<CaptureRecord> inputs;
+  std::string input;
+  size_t n_outputs = 0;
+  bool valid = ForEachCaptureRecord(capture, [&](const CaptureRecord& record) {
+    if (record.kind == CaptureKind::kInput) {
+      inputs.push_back(record);
+      input.append(record.data);
+    } else {
+      ++n_outputs;
+    }
+  });
+  if (!file || !valid) {
+    std::fprintf(stderr, "%s is not a capture\n", path);
+    return 1;
+  }
+
+  LineProtocol flp;
+  size_t output_bytes = 0;
+  flp.SetOutputSink([&](const char*, size_t len) { output_bytes += len; });
+  flp.RegisterInternalCommands();
+  double scratch = 0;
+  RegisterStubs(flp, input, scratch);
+
+  std::map<std::string, Latency> latencies;
+  Latency total;
+  auto start = std::chrono::steady_clock::now();
+  for (auto& record : inputs) {
+    if (!max_speed) {
+      auto offset = static_cast<double>(record.timestamp - inputs.front().timestamp) * tick_ns;
+      std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<int64_t>(offset)));
+    }
+    flp.Feed(record.data);
+    while (flp.GetBuffer().find('\n') != std::string_view::npos) {
+      auto qualifier = PeekQualifier(flp.GetBuffer());
+      auto begin = std::chrono::steady_clock::now();
+      auto summary = flp.ProcessBatch(1);
+      auto ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+      if (summary.processed == 0) {
+        break;
+      }
+      for (auto* latency : {&latencies[qualifier], &total}) {
+        ++latency->count;
+        latency->failed += summary.failed;
+        latency->total_ns += ns;
+        latency->max_ns = std::max(latency->max_ns, ns);
+      }
+    }
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::printf("%zu input records, %zu bytes, %zu output records captured, %zu output bytes replayed, %.3f s%s\n\n",
+              inputs.size(), input.size(), n_outputs, output_bytes, elapsed, max_speed ? ", max speed" : "");
+  std::printf("| command | count | failed | mean ns | max ns |\n|---|---:|---:|---:|---:|\n");
+  auto print_row = [](const std::string& name, const Latency& latency) {
+    std::printf("| %s | %zu | %zu | %.1f | %.1f |\n", name.c_str(), latency.count, latency.failed,
+                latency.count ? latency.total_ns / static_cast<double>(latency.count) : 0.0, latency.max_ns);
+  };
+  for (auto& [qualifier, latency] : latencies) {
+    print_row(qualifier.empty() ? "(empty)" : qualifier, latency);
+  }
+  print_row("total", total);
+  return 0;
+}
@@ -1,12 +1,34 @@
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "cert-err58-cpp"
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <memory_resource>
+#include <random>
 #include <regex>
+#include <sstream>
+#include <thread>
+#include <tuple>
 
 #include "doctest.h"
 #include "flp.h"
 using namespace finix;
 using namespace std::string_literals;
+
+// Count the heap allocations of each thread so the allocation-free paths can be checked.
+static thread_local size_t allocation_count = 0;
+// not inlined, or GCC sees malloc and free paired with a new expression and warns about a mismatch
+[[gnu::noinline]] void* operator new(size_t size) {
+  ++allocation_count;
+  if (void* p = std::malloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+[[gnu::noinline]] void* operator new[](size_t size) { return operator new(size); }
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete[](void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
 TEST_CASE("Command without argument: typical usage") {
   LineProtocol flp;
   int call_count = 0;
@@ -137,8 +159,374 @@ TEST_CASE("Internal commands") {
     flp.Feed("@flp.state\n");
     CHECK(flp.Process());
     std::cout << ss.str() << "\n";
+    // the float states keep the fixed format of std::to_string
+    CHECK_NE(ss.str().find(R"("float_state":2.560000,)"), std::string::npos);
+  }
+}
+TEST_CASE("Cached command registry and paginated state listing") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.RegisterInternalCommands();
+  auto request = [&](const std::string& line) {
+    ss.str("");
+    flp.Feed(line + "\n");
+    CHECK(flp.Process());
+    return ss.str();
+  };
+
+  auto reg = request("@flp.cmd_reg");
+  CHECK_EQ(request("@flp.cmd_reg"), reg);
+  CHECK_NE(reg.find(R"("@flp.state": {"limit":"optional,int","offset":"optional,int"})"), std::string::npos);
+  int arg;
+  float farg;
+  flp.RegisterCommand("test", {{"i", ArgumentSpec(arg, false)}, {"f", ArgumentSpec(farg)}}, nullptr);
+  reg = request("@flp.cmd_reg");
+  CHECK_NE(reg.find(R"("test": {"f":"optional,float","i":"required,int"}})" "\n"), std::string::npos);
+
+  ExchangeState<int> speed(flp, "motor.speed");
+  ExchangeState<float> current(flp, "motor.current");
+  ExchangeState<bool> enabled(flp, "enabled");
+  ExchangeState<int> level(flp, "tank.level");
+  speed = -3;
+  current = 1.5;
+  enabled = true;
+  level = 70;
+  CHECK_EQ(request("@flp.state"), R"(_(0) @flp.state: {"enabled":1,"motor.current":1.500000,"motor.speed":-3,"tank.level":70})" "\n");
+  CHECK_EQ(request("@flp.state motor.=1"), R"(_(0) @flp.state: {"motor.current":1.500000,"motor.speed":-3})" "\n");
+  CHECK_EQ(request("@flp.state motor.=1 tank=1 offset=1 limit=1"), R"(_(0) @flp.state: {"motor.speed":-3})" "\n");
+  CHECK_EQ(request("@flp.state offset=3"), R"(_(0) @flp.state: {"tank.level":70})" "\n");
+  // the paging does not persist
+  CHECK_EQ(request("@flp.state limit=1"), R"(_(0) @flp.state: {"enabled":1})" "\n");
+  CHECK_EQ(request("@flp.state offset=9"), R"(_(0) @flp.state: {})" "\n");
+}
+
+TEST_CASE("Delta sync by state sequence numbers") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.RegisterInternalCommands();
+  auto request = [&](const std::string& line) {
+    ss.str("");
+    flp.Feed(line + "\n");
+    CHECK(flp.Process());
+    return ss.str();
+  };
+
+  ExchangeState<int> speed(flp, "motor.speed");
+  ExchangeState<float> current(flp, "motor.current");
+  ExchangeState<bool> enabled(flp, "enabled");
+  speed = 10;
+  current = 0.5;
+  enabled = false;
+  // enabled did not change
+  CHECK_EQ(enabled.GetSequence(), 3);
+  CHECK_EQ(flp.GetStateSequence(), 5);
+  CHECK_EQ(request("@flp.state.since seq=0"), "_(0) @flp.state.since: seq=5 enabled=0 motor.current=0.500000 motor.speed=10\n");
+
+  auto synced = flp.GetStateSequence();
+  speed = 10;
+  CHECK_EQ(request("@flp.state.since seq=" + std::to_string(synced)), "_(0) @flp.state.since: seq=5\n");
+  speed = 20;
+  ExchangeState<int> level(flp, "tank.level");
+  CHECK_EQ(request("@flp.state.since seq=" + std::to_string(synced)), "_(0) @flp.state.since: seq=7 motor.speed=20 tank.level=0\n");
+  flp.Feed("@flp.state.since\n");
+  CHECK_THROWS_AS(flp.Process(), InvalidArgumentError);
+}
+
+TEST_CASE("Hierarchical routing and mounted namespaces") {
+  LineProtocol flp;
+  int speed = 0, kp = 0;
+  flp.RegisterCommand("motor.set", {{"speed", ArgumentSpec(speed)}}, nullptr);
+  flp.RegisterCommand("motor.pid.kp", {{"value", ArgumentSpec(kp)}}, nullptr);
+  flp.RegisterCommand("motor", {}, nullptr);
+  flp.RegisterCommand("pump.start", {}, nullptr);
+  CHECK(flp.ValidateApply("motor.set speed=3"));
+  CHECK(flp.ValidateApply("motor.pid.kp value=7"));
+  CHECK(flp.ValidateApply("motor"));
+  CHECK_EQ(speed, 3);
+  CHECK_EQ(kp, 7);
+  CHECK_THROWS_AS(flp.ValidateApply("motor.pid"), UnknownQualifierError);
+  CHECK_THROWS_AS(flp.ValidateApply("valve.open"), UnknownQualifierError);
+
+  // a namespace is removed as a whole
+  CHECK_FALSE(flp.UnregisterCommands("valve"));
+  CHECK(flp.UnregisterCommands("motor"));
+  CHECK_THROWS_AS(flp.ValidateApply("motor.set speed=4"), UnknownQualifierError);
+  CHECK_THROWS_AS(flp.ValidateApply("motor"), UnknownQualifierError);
+  CHECK(flp.ValidateApply("pump.start"));
+  CHECK(flp.UnregisterCommand("pump.start"));
+  CHECK_FALSE(flp.UnregisterCommand("pump.start"));
+  flp.RegisterCommand("motor.set", {{"speed", ArgumentSpec(speed)}}, nullptr);
+  flp.Freeze();
+  CHECK(flp.ValidateApply("motor.set speed=5"));
+  CHECK_EQ(speed, 5);
+
+  // delegation to a child
+  LineProtocol child;
+  int level = 0;
+  std::string child_args;
+  child.RegisterCommand("tank.level", {{"value", ArgumentSpec(level)}}, [&](const RawArgumentMap&, const RawArgumentMap& unmatched) {
+    child_args = std::to_string(unmatched.size());
+  });
+  flp.Mount("plant", child);
+  CHECK_THROWS_AS(flp.Mount("plant", child), InvalidArgumentError);
+  CHECK_THROWS_AS(flp.RegisterCommand("plant.reset", {}, nullptr), InvalidArgumentError);
+  // a failed mount leaves the trie as it was
+  auto bytes_used = flp.GetRegistry()->GetBytesUsed();
+  CHECK_THROWS_AS(flp.Mount("motor", child), InvalidArgumentError);
+  CHECK_THROWS_AS(flp.Mount("plant.tank.extra", child), InvalidArgumentError);
+  CHECK_EQ(flp.GetRegistry()->GetBytesUsed(), bytes_used);
+  CHECK(flp.ValidateApply("plant.tank.level value=9 extra=1"));
+  CHECK_EQ(level, 9);
+  CHECK_EQ(child_args, "1");
+  CHECK_THROWS_AS(flp.ValidateApply("plant.tank.volume"), UnknownQualifierError);
+  CHECK(flp.UnregisterCommands("plant"));
+  CHECK_THROWS_AS(flp.ValidateApply("plant.tank.level value=1"), UnknownQualifierError);
+  CHECK(flp.ValidateApply("motor.set speed=6"));
+}
+
+TEST_CASE("Rollback of the arguments of a failed callback") {
+  LineProtocol flp;
+  int speed = 1;
+  float gain = 0.5;
+  ExchangeState<int> mode(flp, "mode");
+  mode = 2;
+  bool reject = false, fail = false;
+  flp.RegisterCommand("motor.set",
+                      {{"speed", ArgumentSpec(speed)}, {"gain", ArgumentSpec(gain)}, {"mode", ArgumentSpec(mode)}},
+                      [&](const RawArgumentMap&, const RawArgumentMap&) {
+                        // the new values are visible to the callback
+                        CHECK_EQ(speed, 10);
+                        if (reject) {
+                          flp.RejectCommand("motor is busy");
+                        }
+                        if (fail) {
+                          throw std::runtime_error("driver fault");
+                        }
+                      });
+
+  reject = true;
+  CHECK_THROWS_WITH_AS(flp.ValidateApply("motor.set speed=10 gain=2.5 mode=3"), "motor is busy", CallbackError);
+  CHECK_EQ(speed, 1);
+  CHECK_EQ(gain, 0.5);
+  CHECK_EQ(mode.Get(), 2);
+  reject = false;
+  fail = true;
+  // a repeated argument goes back to the value from before the command
+  CHECK_THROWS_AS(flp.ValidateApply("motor.set speed=7 speed=10 gain=1.5"), std::runtime_error);
+  CHECK_EQ(speed, 1);
+  CHECK_EQ(gain, 0.5);
+  fail = false;
+  CHECK(flp.ValidateApply("motor.set speed=10 gain=1.5 mode=4"));
+  CHECK_EQ(gain, 1.5);
+  CHECK_EQ(mode.Get(), 4);
+}
+
+TEST_CASE("Sessions sharing one registry") {
+  std::stringstream ss_a, ss_b;
+  LineProtocol a;
+  a.SetOStream(ss_a);
+  a.SetTimestampSource([]() { return int64_t{0}; });
+  a.RegisterInternalCommands();
+  int speed = 0;
+  a.RegisterCommand("motor.set", {{"speed", ArgumentSpec(speed)}}, [&](const RawArgumentMap&, const RawArgumentMap&) {
+    a.Caller().Respond("motor.set", "OK", '_');
+  });
+  ExchangeState<int> level(a, "level");
+
+  LineProtocol b(a.GetRegistry());
+  b.SetOStream(ss_b);
+  b.SetTimestampSource([]() { return int64_t{0}; });
+  CHECK(b.SharesRegistry());
+  CHECK_EQ(a.GetRegistry()->GetSessionCount(), 2);
+  CHECK_EQ(b.GetRegistry()->GetCommandCount(), a.GetRegistry()->GetCommandCount());
+  // registered through either session
+  b.RegisterCommand("pump.start", {}, nullptr);
+  CHECK(a.ValidateApply("pump.start"));
+
+  // the response goes to the session that sent the command, the state reports to all of them
+  b.Feed("motor.set speed=5\n");
+  CHECK(b.Process());
+  CHECK_EQ(speed, 5);
+  CHECK_EQ(ss_a.str(), "");
+  CHECK_EQ(ss_b.str(), "_(0) motor.set: OK\n");
+  ss_b.str("");
+  level = 3;
+  CHECK_EQ(ss_a.str(), "R(0) level: 3\n");
+  CHECK_EQ(ss_b.str(), "R(0) level: 3\n");
+
+  // the internal commands act on the calling session
+  ss_a.str("");
+  ss_b.str("");
+  b.Feed("@flp.binary\n");
+  CHECK(b.Process());
+  CHECK(b.IsBinaryMode());
+  CHECK_FALSE(a.IsBinaryMode());
+  CHECK_EQ(ss_a.str(), "");
+
+  {
+    LineProtocol c(a.GetRegistry());
+    CHECK_EQ(a.GetRegistry()->GetSessionCount(), 3);
   }
+  CHECK_EQ(a.GetRegistry()->GetSessionCount(), 2);
+}
+
+#if FLP_ENABLE_CONCURRENCY
+TEST_CASE("Sessions of a frozen registry on several threads") {
+  LineProtocol hub;
+  std::atomic<int64_t> sum{0};
+  hub.RegisterCommand("add", {}, [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+    sum += static_cast<int64_t>(unmatched.at("value"));
+    hub.Caller().Respond("add", "OK", '_');
+  });
+  hub.RegisterInternalCommands();
+  hub.Freeze();
+
+  const int kSessions = 4;
+  const int kLines = 500;
+  std::vector<std::string> outputs(kSessions);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kSessions; ++t) {
+    threads.emplace_back([&, t]() {
+      std::stringstream ss;
+      LineProtocol session(hub.GetRegistry());
+      session.SetOStream(ss);
+      for (int i = 1; i <= kLines; ++i) {
+        session.Feed("add value=" + std::to_string(i) + "\n@flp.buffer.size\n");
+        session.ProcessAll();
+      }
+      outputs[t] = ss.str();
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  CHECK_EQ(sum, int64_t{kSessions} * kLines * (kLines + 1) / 2);
+  for (auto& output : outputs) {
+    CHECK_EQ(std::count(output.begin(), output.end(), '\n'), 2 * kLines);
+  }
+}
+#endif
+
+#if FLP_ENABLE_CONCURRENCY
+TEST_CASE("State reports from another thread go through the output queues") {
+  std::stringstream ss_a, ss_b;
+  LineProtocol a;
+  a.SetOStream(ss_a);
+  a.SetTimestampSource([]() { return int64_t{0}; });
+  a.EnableOutputQueue(64);
+  LineProtocol b(a.GetRegistry());
+  b.SetOStream(ss_b);
+  b.SetTimestampSource([]() { return int64_t{0}; });
+  b.EnableOutputQueue(64);
+  ExchangeState<int> speed(a, "motor.speed");
+  a.Freeze();
+  CHECK(a.CanWriteFromThisThread());
+  bool can_write = false;
+  std::thread worker([&]() {
+    can_write = b.CanWriteFromThisThread();
+    speed = 5;
+  });
+  worker.join();
+  CHECK(can_write);
+  // nothing is written until the loop threads drain their queues
+  CHECK(ss_a.str().empty());
+  CHECK(ss_b.str().empty());
+  a.DrainOutput();
+  b.DrainOutput();
+  CHECK_EQ(ss_a.str(), "R(0) motor.speed: 5\n");
+  CHECK_EQ(ss_b.str(), "R(0) motor.speed: 5\n");
+}
+#endif
+
+TEST_CASE("State subscriptions per session") {
+  std::stringstream ss_a, ss_b;
+  LineProtocol a;
+  a.SetOStream(ss_a);
+  a.SetTimestampSource([]() { return int64_t{0}; });
+  a.RegisterInternalCommands();
+  LineProtocol b(a.GetRegistry());
+  b.SetOStream(ss_b);
+  b.SetTimestampSource([]() { return int64_t{0}; });
+  ExchangeState<int> speed(a, "motor.speed");
+  ExchangeState<int> current(a, "motor.current");
+  ExchangeState<int> level(a, "tank.level");
+  auto request = [](LineProtocol& flp, std::stringstream& ss, const std::string& line) {
+    ss.str("");
+    flp.Feed(line + "\n");
+    CHECK(flp.Process());
+    return ss.str();
+  };
+
+  CHECK_EQ(request(b, ss_b, "@flp.unsubscribe"), "_(0) @flp.unsubscribe: 3\n");
+  CHECK_EQ(request(b, ss_b, "@flp.subscribe motor.*=1"), "_(0) @flp.subscribe: 2\n");
+  ss_a.str("");
+  ss_b.str("");
+  speed = 1;
+  level = 2;
+  CHECK_EQ(ss_a.str(), "R(0) motor.speed: 1\nR(0) tank.level: 2\n");
+  CHECK_EQ(ss_b.str(), "R(0) motor.speed: 1\n");
+  CHECK_EQ(request(b, ss_b, "@flp.unsubscribe motor.speed=1"), "_(0) @flp.unsubscribe: 1\n");
+
+  // nobody listens: the report is not even formatted
+  CHECK_EQ(request(a, ss_a, "@flp.unsubscribe *=1"), "_(0) @flp.unsubscribe: 3\n");
+  ss_a.str("");
+  ss_b.str("");
+  auto before = allocation_count;
+  speed = 5;
+  level = 5;
+  CHECK_EQ(allocation_count, before);
+  CHECK_EQ(ss_a.str(), "");
+  CHECK_EQ(ss_b.str(), "");
+  current = 3;
+  CHECK_EQ(ss_b.str(), "R(0) motor.current: 3\n");
+
+  // only the sessions that subscribed to all states receive the new ones
+  CHECK_EQ(request(a, ss_a, "@flp.subscribe"), "_(0) @flp.subscribe: 3\n");
+  ExchangeState<int> pressure(a, "pressure");
+  ss_a.str("");
+  ss_b.str("");
+  pressure = 7;
+  CHECK_EQ(ss_a.str(), "R(0) pressure: 7\n");
+  CHECK_EQ(ss_b.str(), "");
+}
+TEST_CASE("First subscription of a fresh session") {
+  std::stringstream ss_a, ss_b;
+  LineProtocol a;
+  a.SetOStream(ss_a);
+  a.SetTimestampSource([]() { return int64_t{0}; });
+  a.RegisterInternalCommands();
+  LineProtocol b(a.GetRegistry());
+  b.SetOStream(ss_b);
+  b.SetTimestampSource([]() { return int64_t{0}; });
+  ExchangeState<int> speed(a, "motor.speed");
+  ExchangeState<int> level(a, "tank.level");
+
+  // the first subscription narrows the reports of b, a still receives everything
+  b.Feed("@flp.subscribe motor.*=1\n");
+  CHECK(b.Process());
+  CHECK_EQ(ss_b.str(), "_(0) @flp.subscribe: 1\n");
+  ss_a.str("");
+  ss_b.str("");
+  speed = 1;
+  level = 2;
+  CHECK_EQ(ss_a.str(), "R(0) motor.speed: 1\nR(0) tank.level: 2\n");
+  CHECK_EQ(ss_b.str(), "R(0) motor.speed: 1\n");
+
+  // a later subscription adds to the list
+  CHECK_EQ(b.Subscribe({"tank.level"}, true), 1);
+  ss_b.str("");
+  level = 3;
+  CHECK_EQ(ss_b.str(), "R(0) tank.level: 3\n");
+  ExchangeState<int> pressure(a, "pressure");
+  ss_b.str("");
+  pressure = 4;
+  CHECK_EQ(ss_b.str(), "");
 }
+
 TEST_CASE("Invalid argument usage") {
   LineProtocol flp;
   float arg;
@@ -360,4 +748,1566 @@ TEST_CASE("Set precision of float output") {
     CHECK(std::regex_match(ss.str(), reg));
   }
 }
+TEST_CASE("Tokenize into fixed-capacity array") {
+  TokenArray<4> tokens;
+  CHECK(Tokenize("  test a=1   b=2 ", tokens));
+  REQUIRE_EQ(tokens.size(), 3);
+  CHECK_EQ(tokens[0], "test");
+  CHECK_EQ(tokens[1], "a=1");
+  CHECK_EQ(tokens[2], "b=2");
+
+  CHECK(Tokenize("   ", tokens));
+  CHECK(tokens.empty());
+
+  CHECK_FALSE(Tokenize("test a=1 b=2 c=3 d=4", tokens));
+}
+
+TEST_CASE("Tokenizer finds the tokens and the '=' positions of long lines") {
+  // the lines span several 16 byte blocks and end in a partial one
+  std::mt19937 rng(21);
+  const char alphabet[] = {' ', ' ', '=', 'a', 'b'};
+  for (int round = 0; round < 2000; ++round) {
+    std::string line(rng() % 80, ' ');
+    for (auto& c : line) {
+      c = alphabet[rng() % sizeof(alphabet)];
+    }
+    std::vector<std::string_view> expected;
+    std::string_view view(line);
+    size_t pos = 0;
+    while ((pos = view.find_first_not_of(' ', pos)) != std::string_view::npos) {
+      auto next = std::min(view.find(' ', pos), view.size());
+      expected.push_back(view.substr(pos, next - pos));
+      pos = next;
+    }
+    TokenArray<64> tokens;
+    REQUIRE(Tokenize(line, tokens));
+    REQUIRE_EQ(tokens.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      CHECK_EQ(tokens[i], expected[i]);
+      CHECK_EQ(tokens[i].data(), expected[i].data());
+      CHECK_EQ(tokens.EqualsPos(i), expected[i].find('='));
+    }
+  }
+}
+
+TEST_CASE("Too many tokens should fail") {
+  LineProtocol flp;
+  flp.RegisterCommand("test", {}, nullptr);
+  std::string line = "test";
+  for (int i = 0; i < FLP_MAX_TOKENS; ++i) {
+    line += " a" + std::to_string(i) + "=1";
+  }
+  CHECK_THROWS_AS(flp.ValidateApply(line), InvalidArgumentError);
+}
+
+TEST_CASE("ValidateApply does not allocate") {
+  LineProtocol flp;
+  int arg;
+  float farg;
+  flp.RegisterCommand("a.long.command.qualifier",
+                      {{"int_arg_with_long_name", ArgumentSpec(arg)},
+                       {"float_arg", ArgumentSpec(farg, false)}},
+                      nullptr);
+  const std::string line = "a.long.command.qualifier   int_arg_with_long_name=5 float_arg=2.5 extra=1";
+  // the first call grows the internal lookup key
+  CHECK(flp.ValidateApply(line));
+
+  auto before = allocation_count;
+  bool ok = flp.ValidateApply(line);
+  CHECK_EQ(allocation_count, before);
+  CHECK(ok);
+  CHECK_EQ(arg, 5);
+  CHECK_EQ(farg, 2.5);
+}
+TEST_CASE("Frozen command table") {
+  LineProtocol flp;
+  flp.RegisterInternalCommands();
+  int arg = 0;
+  float farg = 0;
+  int call_count = 0;
+  flp.RegisterCommand("test",
+                      {{"arg", ArgumentSpec(arg)},
+                       {"farg", ArgumentSpec(farg, false, [](float v) { return v > 0; })}},
+                      [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+                        CHECK_EQ(matched.size(), 2);
+                        CHECK(unmatched.at("other") == 3.0);
+                        call_count++;
+                      });
+  CHECK_FALSE(flp.IsFrozen());
+  flp.Freeze();
+  CHECK(flp.IsFrozen());
+
+  CHECK(flp.ValidateApply("test arg=1 farg=2.5 other=3"));
+  CHECK_EQ(call_count, 1);
+  CHECK_EQ(arg, 1);
+  CHECK_EQ(farg, 2.5);
+  CHECK_THROWS_AS(flp.ValidateApply("test arg=1"), InvalidArgumentError);
+  CHECK_THROWS_AS(flp.ValidateApply("test farg=-1"), ValidatorError);
+  CHECK_THROWS_AS(flp.ValidateApply("unknown"), UnknownQualifierError);
+
+  // registering a new command falls back to the map until frozen again
+  flp.RegisterCommand("test2", {}, nullptr);
+  CHECK_FALSE(flp.IsFrozen());
+  CHECK(flp.ValidateApply("test2"));
+  flp.Freeze();
+  CHECK(flp.ValidateApply("test2"));
+  CHECK(flp.ValidateApply("@flp.version"));
+
+  // so do the states, the schema is rebuilt by the next Freeze and not during the dispatch
+  {
+    ExchangeState<int> state(flp, "test.state");
+    CHECK_FALSE(flp.IsFrozen());
+    flp.Freeze();
+    REQUIRE_EQ(flp.GetBinarySchema().states.size(), 1);
+    CHECK_EQ(flp.GetBinarySchema().states[0].first, "test.state");
+  }
+  CHECK_FALSE(flp.IsFrozen());
+  flp.Freeze();
+  CHECK(flp.GetBinarySchema().states.empty());
+}
+
+TEST_CASE("Frozen dispatch does not allocate") {
+  LineProtocol flp;
+  int arg;
+  flp.RegisterCommand("a.long.command.qualifier", {{"int_arg_with_long_name", ArgumentSpec(arg)}}, nullptr);
+  flp.Freeze();
+  auto before = allocation_count;
+  bool ok = flp.ValidateApply("a.long.command.qualifier int_arg_with_long_name=7");
+  CHECK_EQ(allocation_count, before);
+  CHECK(ok);
+  CHECK_EQ(arg, 7);
+}
+TEST_CASE("Draining a burst keeps the pending input") {
+  LineProtocol flp;
+  int call_count = 0;
+  flp.RegisterCommand("test", {}, [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+    call_count++;
+  });
+  flp.Feed("test\ntest\ntes");
+  CHECK(flp.Process());
+  CHECK_EQ(flp.GetBuffer(), "test\ntes");
+  CHECK(flp.Process());
+  CHECK_FALSE(flp.Process());
+  CHECK_EQ(flp.GetBuffer(), "tes");
+  flp.Feed("t\n");
+  CHECK(flp.Process());
+  CHECK(flp.GetBuffer().empty());
+  CHECK_EQ(call_count, 3);
+}
+
+TEST_CASE("Fixed-capacity buffer discards the line that does not fit") {
+  std::stringstream ss;
+  LineProtocol flp(12, '\n', ss, BufferOverflowPolicy::kDiscardLine);
+  int arg = 0;
+  flp.RegisterCommand("test", {{"arg", ArgumentSpec(arg)}}, nullptr);
+
+  flp.Feed("test arg=1\n");
+  CHECK_EQ(flp.Feed("test arg=22"), 11);
+  CHECK_EQ(flp.GetOverflowCount(), 1);
+  // the complete line is kept, the truncated one is skipped until the delimiter
+  CHECK_EQ(flp.GetBuffer(), "test arg=1\n");
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 1);
+  flp.Feed("2\ntest arg=3\n");
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 3);
+  CHECK_FALSE(flp.Process());
+
+  // a line longer than the capacity never gets through
+  flp.Feed("test arg=4 other=5\ntest arg=6\n");
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 6);
+  CHECK_FALSE(flp.Process());
+  CHECK(flp.GetBuffer().empty());
+}
+
+TEST_CASE("Feed from a command keeps its arguments") {
+  std::stringstream ss;
+  LineProtocol flp(150, '\n', ss);
+  int value = 0;
+  std::vector<std::string> seen;
+  flp.RegisterCommand("test", {{"name", ArgumentSpec(value)}}, [&](const CommandArguments& args) {
+    if (args.Get<int>("name", 0) == 1) {
+      // more than the capacity, so appending to the buffer in place would reallocate it
+      flp.Feed("test name=2 " + std::string(400, ' ') + "\nzzzz zzzz=3\n");
+    }
+    for (auto& arg : args) {
+      seen.push_back(std::string(arg.name) + "=" + std::to_string(arg.value.As<int>()));
+    }
+  });
+  flp.Feed("test name=1\n");
+  CHECK(flp.Process());
+  REQUIRE_EQ(seen.size(), 1);
+  CHECK_EQ(seen[0], "name=1");
+  CHECK_EQ(flp.GetBuffer().substr(0, 12), "test name=2 ");
+  auto summary = flp.ProcessAll();
+  CHECK_EQ(summary.processed, 2);
+  CHECK_EQ(summary.failed, 1);
+  REQUIRE_EQ(seen.size(), 2);
+  CHECK_EQ(seen[1], "name=2");
+
+  // the lines of ProcessBuffer run first, then the input fed by their commands
+  seen.clear();
+  summary = flp.ProcessBuffer("test name=1\ntest name=5\n");
+  CHECK_EQ(summary.processed, 2);
+  CHECK_EQ(seen, std::vector<std::string>{"name=1", "name=5"});
+  flp.ProcessAll();
+  CHECK_EQ(seen.back(), "name=2");
+}
+
+TEST_CASE("Process limits discard long lines") {
+  std::stringstream ss;
+  LineProtocol flp(150, '\n', ss);
+  int arg = 0;
+  flp.RegisterCommand("test", {{"arg", ArgumentSpec(arg)}}, nullptr);
+  flp.SetProcessLimits({16, 0, 0});
+
+  // a partial line is dropped as soon as it is too long, with the rest of its input
+  flp.Feed("test arg=1\ntest arg=");
+  flp.Feed("2222222222");
+  CHECK_EQ(flp.GetOverflowCount(), 1);
+  CHECK_EQ(flp.GetBuffer(), "test arg=1\n");
+  flp.Feed("22222\ntest arg=3\n");
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 1);
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 3);
+  CHECK(flp.GetBuffer().empty());
+
+  // a complete line that arrives in one piece is skipped when it is reached
+  flp.Feed("test arg=4444444444\ntest arg=5\n");
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 5);
+  CHECK_EQ(flp.GetOverflowCount(), 2);
+  auto summary = flp.ProcessBuffer("test arg=6666666666\ntest arg=7\ntest arg=8888888888888");
+  CHECK_EQ(summary.processed, 1);
+  CHECK_EQ(arg, 7);
+  CHECK_EQ(flp.GetOverflowCount(), 4);
+  CHECK(flp.GetBuffer().empty());
+  flp.ProcessBuffer("8\ntest arg=9\n");
+  CHECK_EQ(arg, 9);
+}
+
+TEST_CASE("Process limits bound the tokens and the scan") {
+  std::stringstream ss;
+  LineProtocol flp(150, '\n', ss);
+  int a = 0, b = 0, c = 0;
+  flp.RegisterCommand("test", {{"a", ArgumentSpec(a)}, {"b", ArgumentSpec(b)}, {"c", ArgumentSpec(c)}}, nullptr);
+  flp.SetProcessLimits({0, 3, 0});
+  CHECK(flp.ValidateApply("test a=1 b=2"));
+  CHECK_THROWS_WITH_AS(flp.ValidateApply("test a=1 b=2 c=3"), "Too many tokens", InvalidArgumentError);
+
+  // each call searches at most 16 bytes, the search resumes on the next call
+  flp.SetProcessLimits({0, 0, 16});
+  flp.Feed(std::string(40, ' ') + "\ntest a=5\n");
+  int calls = 0;
+  while (!flp.Process()) {
+    ++calls;
+  }
+  // 16 + 16 + 9 bytes to the blank line, 7 more into the next line
+  CHECK_EQ(calls, 3);
+  CHECK_EQ(a, 5);
+  CHECK(flp.GetBuffer().empty());
+  // ProcessBuffer copies what it did not search
+  auto input = std::string(20, ' ') + "\ntest b=6\n";
+  CHECK_EQ(flp.ProcessBuffer(input).processed, 0);
+  CHECK_EQ(flp.GetBuffer(), input);
+  while (!flp.Process()) {
+  }
+  CHECK_EQ(b, 6);
+}
+
+TEST_CASE("Fixed-capacity buffer rejects the input that does not fit") {
+  std::stringstream ss;
+  LineProtocol flp(12, '\n', ss, BufferOverflowPolicy::kReject);
+  int arg = 0;
+  flp.RegisterCommand("test", {{"arg", ArgumentSpec(arg)}}, nullptr);
+
+  std::string input = "test arg=1\ntest arg=2\n";
+  auto taken = flp.Feed(input);
+  CHECK_EQ(taken, 12);
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 1);
+  // the consumed line makes room for the rest
+  CHECK_EQ(flp.Feed(input.substr(taken)), input.size() - taken);
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 2);
+
+  // a line that fills the whole buffer is dropped
+  flp.Feed("test arg=3333333\ntest arg=4\n");
+  CHECK(flp.Process());
+  CHECK_EQ(arg, 4);
+}
+TEST_CASE("Process all complete lines in one call") {
+  LineProtocol flp;
+  int arg = 0;
+  int call_count = 0;
+  flp.RegisterCommand("test", {{"arg", ArgumentSpec(arg, true, [](float v) { return v > 0; })}}, [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+    call_count++;
+  });
+
+  auto summary = flp.ProcessAll();
+  CHECK_EQ(summary.processed, 0);
+  CHECK_EQ(summary.failed, 0);
+
+  flp.Feed("test arg=1\n\nunknown\ntest arg=-1\ntest arg=2\ntest");
+  summary = flp.ProcessAll();
+  CHECK_EQ(summary.processed, 4);
+  CHECK_EQ(summary.failed, 2);
+  CHECK_EQ(summary.first_error, "Unknown qualifier");
+  CHECK_EQ(call_count, 2);
+  CHECK_EQ(arg, 2);
+  CHECK_EQ(flp.GetBuffer(), "test");
+
+  flp.Feed("\ntest\ntest\n");
+  summary = flp.ProcessBatch(2);
+  CHECK_EQ(summary.processed, 2);
+  CHECK_EQ(summary.failed, 0);
+  CHECK(summary.first_error.empty());
+  CHECK_EQ(flp.GetBuffer(), "test\n");
+  CHECK_EQ(flp.ProcessAll().processed, 1);
+  CHECK_EQ(call_count, 5);
+}
+TEST_CASE("Process the lines of an external buffer in place") {
+  // too small to hold the input, so the complete lines must not be copied
+  LineProtocol flp(16, '\n', std::cout, BufferOverflowPolicy::kReject);
+  int arg = 0;
+  int sum = 0;
+  flp.RegisterCommand("test", {{"arg", ArgumentSpec(arg)}}, [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+    sum += arg;
+  });
+
+  flp.Feed("test ar");
+  std::string dma = "g=1\ntest arg=2\n\ntest arg=x\n";
+  for (int i = 3; i <= 10; ++i) {
+    dma += "test arg=" + std::to_string(i) + "\n";
+  }
+  dma += "test a";
+  auto summary = flp.ProcessBuffer(dma);
+  CHECK_EQ(summary.processed, 11);
+  CHECK_EQ(summary.failed, 1);
+  CHECK_EQ(sum, 55);
+  CHECK_EQ(flp.GetOverflowCount(), 0);
+  // only the partial line is kept
+  CHECK_EQ(flp.GetBuffer(), "test a");
+  // the caller can reuse the buffer
+  dma.assign(dma.size(), 'x');
+
+  const std::string next = "rg=5\ntest arg=6\ntest arg=7\n";
+  summary = flp.ProcessBuffer(next.data(), next.size(), 2);
+  CHECK_EQ(summary.processed, 2);
+  CHECK_EQ(sum, 66);
+  CHECK_EQ(flp.GetBuffer(), "test arg=7\n");
+  CHECK_EQ(flp.ProcessAll().processed, 1);
+  CHECK_EQ(sum, 73);
+}
+
+TEST_CASE("Process an external buffer into a fixed-capacity buffer") {
+  LineProtocol flp(32, '\n', std::cout, BufferOverflowPolicy::kReject);
+  int count = 0;
+  flp.RegisterCommand("go", {}, [&](const CommandArguments&) { ++count; });
+  std::string dma;
+  for (int i = 0; i < 20; ++i) {
+    dma += "go\n";
+  }
+  // the lines beyond max_commands do not all fit, the caller passes the rest again
+  auto summary = flp.ProcessBuffer(dma.data(), dma.size(), 2);
+  CHECK_EQ(summary.processed, 2);
+  CHECK_LT(summary.taken, dma.size());
+  size_t pos = summary.taken;
+  while (pos < dma.size()) {
+    summary = flp.ProcessBuffer(dma.data() + pos, dma.size() - pos, 2);
+    REQUIRE_GT(summary.processed + summary.taken, 0);
+    pos += summary.taken;
+  }
+  flp.ProcessAll();
+  CHECK_EQ(count, 20);
+  // the rejections are counted, but no line is lost
+  CHECK_GT(flp.GetOverflowCount(), 0);
+}
+TEST_CASE("Processing cleans up when a callback throws") {
+  std::stringstream ss;
+  LineProtocol flp(150, '\n', ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  int sum = 0;
+  flp.RegisterCommand("add", {}, [&](const CommandArguments&) { ++sum; });
+  // not a std::exception, so the batch does not count it as a failure
+  flp.RegisterCommand("abort", {}, [&](const CommandArguments&) { throw 1; });
+  flp.RegisterCommand("feed", {}, [&](const CommandArguments&) {
+    flp.Feed("add\n");
+    throw std::runtime_error("fed and failed");
+  });
+
+  // the rest of the chunk is kept although the caller reuses the buffer
+  std::string dma = "add\nabort\nadd\nadd\nad";
+  CHECK_THROWS_AS(flp.ProcessBuffer(dma), int);
+  dma.assign(dma.size(), 'x');
+  CHECK_EQ(sum, 1);
+  CHECK_EQ(flp.GetBuffer(), "add\nadd\nad");
+  CHECK_EQ(flp.ProcessAll().processed, 2);
+  CHECK_EQ(sum, 3);
+
+  // the input fed by the callback is stored
+  flp.Feed("d\nfeed\n");
+  CHECK(flp.Process());
+  CHECK_THROWS_AS(flp.Process(), std::runtime_error);
+  CHECK_EQ(flp.GetBuffer(), "add\n");
+  CHECK(flp.Process());
+  CHECK_EQ(sum, 5);
+}
+#if FLP_ENABLE_CONCURRENCY
+TEST_CASE("Queued output is written when a callback throws") {
+  std::stringstream ss;
+  LineProtocol flp(150, '\n', ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.EnableOutputQueue(64);
+  flp.RegisterCommand("fail", {}, [&](const CommandArguments&) {
+    flp.Respond("note", "before");
+    throw 1;
+  });
+  flp.Feed("fail\n");
+  CHECK_THROWS_AS(flp.Process(), int);
+  CHECK_EQ(ss.str(), "R(0) note: before\n");
+  ss.str("");
+  CHECK_THROWS_AS(flp.ProcessBuffer("fail\n"), int);
+  CHECK_EQ(ss.str(), "R(0) note: before\n");
+}
+#endif
+
+namespace static_schema {
+inline constexpr char kMotorSet[] = "motor.set";
+inline constexpr char kMotorStop[] = "motor.stop";
+inline constexpr char kMotorHome[] = "motor.home";
+inline constexpr char kSpeed[] = "speed";
+inline constexpr char kDir[] = "dir";
+inline constexpr char kEnabled[] = "enabled";
+float speed = 0;
+int dir = 0;
+int stop_count = 0;
+LineProtocol state_flp;
+ExchangeState<bool> enabled(state_flp, "enabled");
+void OnStop() { stop_count++; }
+void OnHome() { throw std::runtime_error("not homed"); }
+bool IsPositive(float v) { return v > 0; }
+
+using MotorSet = Command<kMotorSet,
+                         nullptr,
+                         Arg<kSpeed, &speed, true, &IsPositive>,
+                         Arg<kDir, &dir, false>,
+                         Arg<kEnabled, &enabled>>;
+using MotorStop = Command<kMotorStop, &OnStop>;
+using MotorHome = Command<kMotorHome, &OnHome, Arg<kDir, &dir>>;
+using MotorTable = StaticCommandTable<MotorSet, MotorStop, MotorHome>;
+}  // namespace static_schema
+
+TEST_CASE("Static command table") {
+  using namespace static_schema;
+  CHECK(MotorTable::ValidateApply("motor.set speed=2.5 dir=-1"));
+  CHECK_EQ(speed, 2.5);
+  CHECK_EQ(dir, -1);
+  CHECK(MotorTable::ValidateApply("motor.set dir=1 enabled=1"));
+  CHECK(enabled.Get());
+
+  CHECK_THROWS_AS(MotorTable::ValidateApply("motor.set speed=1"), InvalidArgumentError);
+  CHECK_THROWS_AS(MotorTable::ValidateApply("motor.set dir=1.5"), InvalidArgumentError);
+  CHECK_THROWS_AS(MotorTable::ValidateApply("motor.set dir=1 speed=-1"), ValidatorError);
+  CHECK_THROWS_AS(MotorTable::ValidateApply("motor.set dir=1 enabled=2"), ValidatorError);
+  CHECK_THROWS_AS(MotorTable::ValidateApply("motor.set dir=1 other=2"), InvalidArgumentError);
+  CHECK_THROWS_AS(MotorTable::ValidateApply("motor.run"), UnknownQualifierError);
+  // nothing is applied if the validation fails
+  CHECK_EQ(dir, 1);
+
+  stop_count = 0;
+  CHECK(MotorTable::ValidateApply("motor.stop"));
+  CHECK_EQ(stop_count, 1);
+  // the arguments are restored when the callback throws
+  CHECK_THROWS_AS(MotorTable::ValidateApply("motor.home dir=5"), std::runtime_error);
+  CHECK_EQ(dir, 1);
+}
+
+TEST_CASE("Static commands alongside the runtime registration") {
+  using namespace static_schema;
+  LineProtocol flp;
+  int call_count = 0;
+  flp.RegisterCommand("runtime", {}, [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+    call_count++;
+  });
+  flp.UseStaticCommands<MotorTable>();
+  stop_count = 0;
+  flp.Feed("motor.stop\nruntime\nmotor.set dir=3\n");
+  auto summary = flp.ProcessAll();
+  CHECK_EQ(summary.failed, 0);
+  CHECK_EQ(stop_count, 1);
+  CHECK_EQ(call_count, 1);
+  CHECK_EQ(dir, 3);
+
+  auto before = allocation_count;
+  bool ok = flp.ValidateApply("motor.set dir=4 speed=1");
+  CHECK_EQ(allocation_count, before);
+  CHECK(ok);
+}
+TEST_CASE("InplaceFunction") {
+  Validator empty;
+  CHECK_FALSE(empty);
+  CHECK_FALSE(Validator(nullptr));
+  CHECK_FALSE(Validator(std::function<bool(float)>()));
+  bool (*null_fn)(float) = nullptr;
+  CHECK_FALSE(Validator(null_fn));
+
+  float threshold = 2;
+  auto before = allocation_count;
+  Validator greater = [&](float v) { return v > threshold; };
+  Validator copy = greater;
+  Validator moved = std::move(copy);
+  CHECK_EQ(allocation_count, before);
+  CHECK(greater);
+  CHECK(moved(3));
+  CHECK_FALSE(moved(1));
+  threshold = 0;
+  CHECK(moved(1));
+
+  moved = nullptr;
+  CHECK_FALSE(moved);
+  moved = greater;
+  CHECK(moved(1));
+
+  // counts the live copies of the callable
+  auto counter = std::make_shared<int>(0);
+  {
+    CommandCallback callback = [counter](const RawArgumentMap&, const RawArgumentMap&) { ++*counter; };
+    CommandCallback callback_copy = callback;
+    CHECK_EQ(counter.use_count(), 3);
+    callback({}, {});
+    callback_copy({}, {});
+    CHECK_EQ(*counter, 2);
+  }
+  CHECK_EQ(counter.use_count(), 1);
+}
+TEST_CASE("Parse numeric values") {
+  NumericValue v;
+  CHECK(ParseNumericValue("42", v));
+  CHECK(v.is_int);
+  CHECK_EQ(v.int_val, 42);
+  CHECK(ParseNumericValue("+7", v));
+  CHECK_EQ(v.int_val, 7);
+  CHECK(ParseNumericValue("-9007199254740993", v));
+  CHECK(v.is_int);
+  CHECK_EQ(v.int_val, -9007199254740993);
+
+  CHECK(ParseNumericValue("2.5", v));
+  CHECK_FALSE(v.is_int);
+  CHECK_EQ(v.float_val, 2.5);
+  CHECK(ParseNumericValue("-1e3", v));
+  CHECK_FALSE(v.is_int);
+  CHECK_EQ(v.float_val, -1000.0);
+  CHECK(ParseNumericValue(".5", v));
+  CHECK_EQ(v.float_val, 0.5);
+
+  CHECK_FALSE(ParseNumericValue("", v));
+  CHECK_FALSE(ParseNumericValue("+", v));
+  CHECK_FALSE(ParseNumericValue("+-1", v));
+  CHECK_FALSE(ParseNumericValue("1x", v));
+  CHECK_FALSE(ParseNumericValue("1.5.2", v));
+  CHECK_FALSE(ParseNumericValue("abc", v));
+}
+
+TEST_CASE("Wide argument types are assigned without float round trip") {
+  LineProtocol flp;
+  double d = 0;
+  int64_t i64 = 0;
+  uint32_t u32 = 0;
+  int i = 0;
+  flp.RegisterCommand("test",
+                      {{"d", ArgumentSpec(d)},
+                       {"i64", ArgumentSpec(i64)},
+                       {"u32", ArgumentSpec(u32)},
+                       {"i", ArgumentSpec(i)}},
+                      nullptr);
+  CHECK(flp.ValidateApply("test d=0.1 i64=9007199254740993 u32=4294967295 i=16777217"));
+  CHECK_EQ(d, 0.1);
+  CHECK_EQ(i64, 9007199254740993);
+  CHECK_EQ(u32, 4294967295u);
+  CHECK_EQ(i, 16777217);
+
+  CHECK_THROWS_AS(flp.ValidateApply("test u32=-1"), InvalidArgumentError);
+  CHECK_THROWS_AS(flp.ValidateApply("test u32=4294967296"), InvalidArgumentError);
+  CHECK_THROWS_AS(flp.ValidateApply("test i=2147483648"), InvalidArgumentError);
+  CHECK_THROWS_AS(flp.ValidateApply("test i64=1.5"), InvalidArgumentError);
+  CHECK_EQ(u32, 4294967295u);
+
+  ExchangeState<uint32_t> counter(flp, "counter");
+  counter.report_state = false;
+  flp.RegisterCommand("set_counter", {{"v", ArgumentSpec(counter)}}, nullptr);
+  CHECK(flp.ValidateApply("set_counter v=4294967295"));
+  CHECK_EQ(counter.Get(), 4294967295u);
+}
+TEST_CASE("Registry in a static arena") {
+  alignas(std::max_align_t) static char arena[16384];
+  std::pmr::monotonic_buffer_resource resource(arena, sizeof(arena), std::pmr::null_memory_resource());
+  auto registry = std::make_shared<CommandRegistry>(&resource);
+  LineProtocol flp(registry);
+  int speed = 0;
+  ArgumentMap arg_map{{"speed", ArgumentSpec(speed, false)}, {"accel", ArgumentSpec(speed)}};
+  ExchangeState<int> level(flp, "tank.level");
+  const char* names[] = {"motor0.set", "motor1.set", "motor2.set", "pump.set", "pump.stop"};
+
+  auto before = allocation_count;
+  for (auto* name : names) {
+    flp.RegisterCommand(name, arg_map, nullptr);
+  }
+  flp.Freeze();
+  auto allocations = allocation_count - before;
+  CHECK_EQ(allocations, 0);
+  auto used = registry->GetBytesUsed();
+  CHECK_GT(used, 0);
+  CHECK_LE(used, sizeof(arena));
+  CHECK_GE(registry->GetPeakBytesUsed(), used);
+  CHECK(flp.ValidateApply("motor1.set speed=3"));
+  CHECK_EQ(speed, 3);
+
+  LineProtocol other;
+  other.RegisterCommand("pump.set", arg_map, nullptr);
+  auto with_command = other.GetRegistry()->GetBytesUsed();
+  CHECK(other.UnregisterCommand("pump.set"));
+  CHECK_LT(other.GetRegistry()->GetBytesUsed(), with_command);
+}
+namespace bulk_table {
+int speed = 0;
+size_t stops = 0;
+const CommandDefinition kCommands[] = {
+    {"motor.set", {{"speed", ArgumentSpec(speed, false)}}, nullptr},
+    {"motor.stop", {}, [](const CommandArguments&) { ++stops; }},
+};
+}  // namespace bulk_table
+TEST_CASE("Bulk registration from a static table") {
+  LineProtocol flp;
+  CHECK(flp.RegisterCommands(bulk_table::kCommands, std::size(bulk_table::kCommands)));
+  CHECK_EQ(flp.GetRegistry()->GetCommandCount(), 2);
+  CHECK(flp.ValidateApply("motor.set speed=7"));
+  CHECK(flp.ValidateApply("motor.stop"));
+  CHECK_EQ(bulk_table::speed, 7);
+  CHECK_EQ(bulk_table::stops, 1);
+  // the same table registers again in another registry
+  LineProtocol other;
+  CHECK(other.RegisterCommands(bulk_table::kCommands, std::size(bulk_table::kCommands)));
+  CHECK(other.ValidateApply("motor.stop"));
+  CHECK_EQ(bulk_table::stops, 2);
+}
+TEST_CASE("Bulk registration") {
+  LineProtocol flp;
+  flp.GetRegistry()->Reserve(8, 8);
+  int speed = 0, level = 0;
+  size_t stops = 0;
+  CHECK(flp.RegisterCommands({
+      {"motor.set", {{"speed", ArgumentSpec(speed, false)}}, nullptr},
+      {"motor.stop", {}, [&](const CommandArguments&) { ++stops; }},
+      {"tank.set", {{"level", ArgumentSpec(level)}}, nullptr},
+  }));
+  CHECK_EQ(flp.GetRegistry()->GetCommandCount(), 3);
+  CHECK(flp.ValidateApply("motor.set speed=5"));
+  CHECK(flp.ValidateApply("motor.stop"));
+  CHECK_EQ(speed, 5);
+  CHECK_EQ(stops, 1);
+  CHECK_THROWS_WITH_AS(flp.ValidateApply("motor.set"), "speed is required", InvalidArgumentError);
+  CHECK_THROWS_WITH_AS(flp.RegisterCommands({{"tank.set", {}, nullptr}}), "tank.set is already registered", InvalidArgumentError);
+  CHECK_EQ(flp.GetRegistry()->GetCommandCount(), 3);
+
+  ExchangeState<int> a(flp, "a", DeferRegistration{});
+  ExchangeState<float> b(flp, "b", DeferRegistration{});
+  CHECK_FALSE(a.IsRegistered());
+  CHECK_EQ(flp.GetRegistry()->GetStateCount(), 0);
+  CHECK(flp.RegisterExchangeStates(a, b));
+  CHECK(a.IsRegistered());
+  CHECK(b.Register());
+  CHECK_EQ(flp.GetRegistry()->GetStateCount(), 2);
+  {
+    // a deferred state that is never registered does not unregister the state of the same name
+    ExchangeState<int> other(flp, "a", DeferRegistration{});
+  }
+  CHECK_EQ(flp.GetRegistry()->GetStateCount(), 2);
+}
+TEST_CASE("Asynchronous commands complete through their token") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  int64_t now = 100;
+  flp.SetTimestampSource([&]() { return now; });
+  flp.RegisterInternalCommands();
+  int target = 0;
+  std::vector<CompletionToken> tokens;
+  flp.RegisterCommand("motor.home", {{"speed", ArgumentSpec(target)}}, [&](const CommandArguments& args, CompletionToken token) {
+    if (args.Get<int>("speed") < 0) {
+      flp.RejectCommand("negative speed");
+      return;
+    }
+    tokens.push_back(token);
+  });
+  auto request = [&](const std::string& line) {
+    ss.str("");
+    flp.Feed(line + "\n");
+    CHECK(flp.Process());
+    return ss.str();
+  };
+
+  // the loop keeps dispatching while the commands are in flight
+  CHECK_EQ(request("motor.home speed=3"), "");
+  now = 110;
+  CHECK_EQ(request("motor.home speed=4"), "");
+  CHECK_EQ(target, 4);
+  CHECK_EQ(flp.GetInflightCount(), 2);
+  now = 150;
+  CHECK_EQ(request("@flp.inflight"),
+           R"(_(150) @flp.inflight: [{"id":1,"command":"motor.home","age":50},{"id":2,"command":"motor.home","age":40}])" "\n");
+
+  ss.str("");
+  CHECK(tokens[1].Complete());
+  CHECK(tokens[0].Fail("stalled"));
+  CHECK_FALSE(tokens[0].Complete());
+  CHECK_EQ(ss.str(), "_(150) motor.home: OK\nE(150) motor.home: stalled\n");
+  CHECK_EQ(request("@flp.inflight"), "_(150) @flp.inflight: []\n");
+
+  // a rejection before the handler returns restores the arguments and frees the slot
+  CHECK_THROWS_AS(flp.ValidateApply("motor.home speed=-1"), CallbackError);
+  CHECK_EQ(target, 4);
+  CHECK_EQ(flp.GetInflightCount(), 0);
+
+  for (int i = 0; i < FLP_MAX_INFLIGHT; ++i) {
+    CHECK(flp.ValidateApply("motor.home"));
+  }
+  CHECK_THROWS_WITH_AS(flp.ValidateApply("motor.home"), "Too many commands in flight", CallbackError);
+  // the tokens of an unregistered command complete nothing
+  CHECK(flp.UnregisterCommand("motor.home"));
+  CHECK_EQ(flp.GetInflightCount(), 0);
+  CHECK_FALSE(tokens.back().Complete());
+}
+TEST_CASE("Deprecated float accessors of ExchangeState") {
+  LineProtocol flp;
+  ExchangeState<uint32_t> counter(flp, "counter");
+  counter = 7;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+  CHECK_EQ(counter.Getter()(), 7.0f);
+  counter.Setter()(12.0f);
+#pragma GCC diagnostic pop
+  CHECK_EQ(counter.Get(), 12);
+}
+TEST_CASE("Handler receives the typed arguments") {
+  LineProtocol flp;
+  uint32_t id = 0;
+  bool enable = false;
+  std::vector<std::string> seen;
+  int64_t big = 0;
+  double gain = 0;
+  flp.RegisterCommand("test",
+                      {{"id", ArgumentSpec(id)}, {"enable", ArgumentSpec(enable)}},
+                      [&](const CommandArguments& args) {
+                        seen.clear();
+                        for (auto& arg : args) {
+                          seen.push_back(std::string(arg.name) + (arg.IsPredefined() ? "+" : "-"));
+                        }
+                        big = args.Get<int64_t>("big");
+                        gain = args.Get<double>("gain", -1);
+                      });
+  CHECK(flp.ValidateApply("test id=4294967295 big=9007199254740993 enable=1 gain=0.1"));
+  CHECK_EQ(seen, std::vector<std::string>{"id+", "big-", "enable+", "gain-"});
+  CHECK_EQ(id, 4294967295u);
+  CHECK(enable);
+  CHECK_EQ(big, 9007199254740993);
+  CHECK_EQ(gain, 0.1);
+
+  // neither maps nor strings are built for the handler
+  std::string line = "test id=7 big=1";
+  auto before = allocation_count;
+  CHECK(flp.ValidateApply(line));
+  auto allocations = allocation_count - before;
+  CHECK_EQ(allocations, 0);
+  CHECK_EQ(gain, -1);
+
+  CommandArgument repeated[] = {{"a", NumericValue::Of(1), nullptr}, {"a", NumericValue::Of(2), nullptr}};
+  CommandArguments view(repeated, 2);
+  CHECK_EQ(view.Get<int>("a"), 2);
+  CHECK_FALSE(view.Has("b"));
+}
+TEST_CASE("Arguments are resolved by slot") {
+  LineProtocol flp;
+  int a = 0, b = 0, c = 0;
+  const CommandArgument* at_slot[3]{};
+  ArgumentMask supplied = 0;
+  flp.RegisterCommand("test",
+                      {{"c", ArgumentSpec(c, false)}, {"a", ArgumentSpec(a)}, {"b", ArgumentSpec(b, false)}},
+                      [&](const CommandArguments& args) {
+                        for (size_t i = 0; i < 3; ++i) {
+                          at_slot[i] = args.AtSlot(i);
+                        }
+                        supplied = args.Supplied();
+                      });
+  // the slots follow the names
+  CHECK(flp.ValidateApply("test c=3 b=2 b=5 x=1"));
+  CHECK_EQ(supplied, 0b110);
+  CHECK_EQ(at_slot[0], nullptr);
+  REQUIRE_NE(at_slot[1], nullptr);
+  CHECK_EQ(at_slot[1]->value.As<int>(), 5);
+  CHECK_EQ(at_slot[2]->name, "c");
+  CHECK_EQ(b, 5);
+
+  CHECK_THROWS_WITH_AS(flp.ValidateApply("test a=1 c=1"), "b is required", InvalidArgumentError);
+  CHECK_THROWS_WITH_AS(flp.ValidateApply("test b=1"), "c is required", InvalidArgumentError);
+  flp.Freeze();
+  CHECK_THROWS_WITH_AS(flp.ValidateApply("test a=1 c=1"), "b is required", InvalidArgumentError);
+  CHECK(flp.ValidateApply("test a=1 b=1 c=1"));
+  CHECK_EQ(supplied, 0b111);
+
+  std::vector<int> many(CommandSpec::kMaxArguments + 1);
+  ArgumentMap arg_map;
+  for (size_t i = 0; i < many.size(); ++i) {
+    arg_map.try_emplace("arg" + std::to_string(i), many[i]);
+  }
+  LineProtocol other;
+  CHECK_THROWS_WITH_AS(other.RegisterCommand("many", arg_map, nullptr), "many has too many arguments", InvalidArgumentError);
+
+  // a line holds FLP_MAX_TOKENS - 1 arguments, more required ones could never be supplied
+  ArgumentMap required;
+  for (size_t i = 0; i < FLP_MAX_TOKENS; ++i) {
+    required.try_emplace("arg" + std::to_string(i), many[i], false);
+  }
+  CHECK_THROWS_WITH_AS(other.RegisterCommand("required", required, nullptr), "required has too many required arguments",
+                       InvalidArgumentError);
+  required.erase("arg0");
+  CHECK(other.RegisterCommand("required", required, nullptr));
+  // optional ones can be many, a line supplies some of them
+  arg_map.erase("arg0");
+  CHECK(other.RegisterCommand("many", arg_map, nullptr));
+  CHECK(other.ValidateApply("many arg1=1 arg64=2"));
+  CHECK_EQ(many[64], 2);
+  other.SetProcessLimits({0, 4, 0});
+  CHECK_THROWS_WITH_AS(other.RegisterCommand("required4", required, nullptr), "required4 has too many required arguments",
+                       InvalidArgumentError);
+}
+TEST_CASE("State values are reported in their own type") {
+  LineProtocol flp;
+  std::stringstream ss;
+  flp.SetOStream(ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.RegisterInternalCommands();
+  ExchangeState<uint32_t> counter(flp, "counter");
+  ExchangeState<int64_t> total(flp, "total");
+  ExchangeState<double> ratio(flp, "ratio");
+  counter.report_state = false;
+  total.report_state = false;
+  ratio.report_state = false;
+  counter = 16777217;
+  total = 9007199254740993;
+  ratio = 0.1;
+  CHECK(flp.ValidateApply("@flp.state"));
+  CHECK_EQ(ss.str(), R"(_(0) @flp.state: {"counter":16777217,"ratio":0.100000,"total":9007199254740993})" "\n");
+}
+TEST_CASE("Format state values") {
+  char buf[64];
+  auto format = [&](auto v, int n_decimal = -1) {
+    return std::string(buf, FormatValue(buf, buf + sizeof(buf), v, n_decimal));
+  };
+  CHECK_EQ(format(true), "1");
+  CHECK_EQ(format((int8_t)-23), "-23");
+  CHECK_EQ(format((uint8_t)23), "23");
+  CHECK_EQ(format(4294967295u), "4294967295");
+  CHECK_EQ(format(2.56f), "2.56");
+  CHECK_EQ(format(0.1), "0.1");
+  CHECK_EQ(format(1e20), "1e+20");
+  CHECK_EQ(format(10.0f, 5), "10.00000");
+  CHECK_EQ(format(2.25, 1), "2.2");
+  CHECK_EQ(FormatValue(buf, buf + 2, 123), 0);
+}
+
+TEST_CASE("Capture log round trip") {
+  CaptureLog log(64);
+  log.Record(CaptureKind::kInput, 1000, "motor.set speed=1\n", 18);
+  log.Record(CaptureKind::kOutput, 1003, "_(1003) ok\n", 11);
+  log.Record(CaptureKind::kInput, 990, "x\n", 2);
+  CHECK_EQ(log.GetRecordCount(), 3);
+  std::vector<std::tuple<CaptureKind, int64_t, std::string>> records;
+  auto read = [&](const CaptureLog& log) {
+    std::string saved;
+    log.Save(saved);
+    records.clear();
+    return ForEachCaptureRecord(saved, [&](const CaptureRecord& record) {
+      records.emplace_back(record.kind, record.timestamp, std::string(record.data));
+    });
+  };
+  CHECK(read(log));
+  REQUIRE_EQ(records.size(), 3);
+  CHECK_EQ(records[0], std::make_tuple(CaptureKind::kInput, int64_t{1000}, std::string("motor.set speed=1\n")));
+  CHECK_EQ(records[1], std::make_tuple(CaptureKind::kOutput, int64_t{1003}, std::string("_(1003) ok\n")));
+  CHECK_EQ(std::get<1>(records[2]), 990);
+
+  // the ring wraps around and keeps the newest records with their timestamps
+  for (int i = 0; i < 20; ++i) {
+    auto line = std::to_string(i) + "\n";
+    log.Record(CaptureKind::kInput, 2000 + 10 * i, line.data(), line.size());
+  }
+  CHECK_GT(log.GetDroppedCount(), 0);
+  CHECK_LE(log.size(), log.capacity());
+  CHECK(read(log));
+  REQUIRE_EQ(records.size(), log.GetRecordCount());
+  CHECK_EQ(records.back(), std::make_tuple(CaptureKind::kInput, int64_t{2190}, std::string("19\n")));
+  auto first = records.size() - 1;
+  CHECK_EQ(std::get<1>(records[0]), 2190 - 10 * static_cast<int64_t>(first));
+
+  std::string too_large(100, 'x');
+  log.Record(CaptureKind::kInput, 0, too_large.data(), too_large.size());
+  CHECK_EQ(log.GetRecordCount(), records.size());
+
+  std::string saved;
+  log.Save(saved);
+  CHECK_FALSE(ForEachCaptureRecord(saved.substr(0, saved.size() - 1), [](const CaptureRecord&) {}));
+  CHECK_FALSE(ForEachCaptureRecord("FLPX", [](const CaptureRecord&) {}));
+}
+TEST_CASE("Capture the stream of a LineProtocol") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  int64_t now = 5;
+  flp.SetTimestampSource([&]() { return now; });
+  flp.RegisterCommand("echo", {}, [&](const CommandArguments&) { flp.Respond("echo", "hi", '_'); });
+  CaptureLog log(1024);
+  flp.SetCapture(&log);
+  flp.Feed("ec");
+  now = 7;
+  flp.Feed("ho\n");
+  flp.ProcessAll();
+  now = 9;
+  flp.ProcessBuffer("echo\necho\n");
+  flp.SetCapture(nullptr);
+  flp.Feed("echo\n");
+  flp.ProcessAll();
+
+  std::string saved, text;
+  log.Save(saved);
+  CHECK(ForEachCaptureRecord(saved, [&](const CaptureRecord& record) {
+    text += (record.kind == CaptureKind::kInput ? "< " : "> ") + std::to_string(record.timestamp) + " " + std::string(record.data);
+  }));
+  CHECK_EQ(text, "< 5 ec< 7 ho\n> 7 _(7) echo: hi\n< 9 echo\necho\n> 9 _(9) echo: hi\n> 9 _(9) echo: hi\n");
+}
+TEST_CASE("Respond into an output sink") {
+  LineProtocol flp;
+  std::string out;
+  size_t n_writes = 0;
+  flp.SetOutputSink([&](const char* data, size_t len) {
+    out.append(data, len);
+    n_writes++;
+  });
+  out.reserve(1024);
+  ExchangeState<float> float_state(flp, "float_state");
+
+  auto before = allocation_count;
+  float_state = 1.5f;
+  flp.Respond("channel", "message", '_');
+  CHECK_EQ(allocation_count, before);
+  CHECK_EQ(n_writes, 2);
+  CHECK(std::regex_match(out, std::regex(R"(R\(\d+\) float_state: 1.5\n_\(\d+\) channel: message\n)")));
+
+  // a message longer than the buffer is written in chunks
+  out.clear();
+  n_writes = 0;
+  std::string long_message(FLP_RESPONSE_BUFFER_SIZE * 2, 'x');
+  flp.Respond("channel", long_message);
+  CHECK_GT(n_writes, 1);
+  CHECK(std::regex_match(out, std::regex(R"(R\(\d+\) channel: x+\n)")));
+  CHECK_EQ(out.size() - out.find(": ") - 3, long_message.size());
+}
+TEST_CASE("Coalesced state reports") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  ExchangeState<int> a(flp, "a");
+  ExchangeState<float> b(flp, "b");
+  flp.SetReportMode(ReportMode::kCoalesced, 3600 * 1000);
+
+  for (int i = 0; i <= 100; ++i) {
+    a = i;
+  }
+  b = 1.5f;
+  CHECK(ss.str().empty());
+  flp.FlushStates();
+  CHECK(std::regex_match(ss.str(), std::regex(R"(R\(\d+\) a: 100\nR\(\d+\) b: 1.5\n)")));
+
+  // unchanged values are not sent again
+  ss.str("");
+  a = 100;
+  b = 1.5f;
+  flp.FlushStates();
+  CHECK(ss.str().empty());
+
+  // Tick is limited by the interval
+  a = 1;
+  flp.Tick();
+  CHECK(ss.str().empty());
+  flp.FlushStates();
+  CHECK(std::regex_match(ss.str(), std::regex(R"(R\(\d+\) a: 1\n)")));
+
+  // a destroyed state leaves the dirty list
+  ss.str("");
+  {
+    ExchangeState<int> c(flp, "c");
+    c = 5;
+  }
+  flp.FlushStates();
+  CHECK(ss.str().empty());
+
+  // switching back flushes the pending reports
+  a = 2;
+  flp.SetReportMode(ReportMode::kImmediate);
+  CHECK(std::regex_match(ss.str(), std::regex(R"(R\(\d+\) a: 2\n)")));
+}
+
+TEST_CASE("Tick flushes the dirty states") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  ExchangeState<int> a(flp, "a");
+  flp.SetReportMode(ReportMode::kCoalesced, 0);
+  flp.Tick();
+  CHECK(ss.str().empty());
+  a = 1;
+  flp.Tick();
+  CHECK(std::regex_match(ss.str(), std::regex(R"(R\(\d+\) a: 1\n)")));
+}
+
+TEST_CASE("Injected timestamp source") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  int64_t ticks = 41;
+  size_t reads = 0;
+  flp.SetTimestampSource([&]() {
+    ++reads;
+    return ++ticks;
+  });
+  flp.Respond("a", "x");
+  flp.Respond("b", "y");
+  CHECK_EQ(ss.str(), "R(42) a: x\nR(43) b: y\n");
+  CHECK_EQ(reads, 2);
+
+  // the reports flushed together share one read
+  ExchangeState<int> s1(flp, "s1"), s2(flp, "s2"), s3(flp, "s3");
+  flp.SetReportMode(ReportMode::kCoalesced, 10);
+  s1 = 1;
+  s2 = 2;
+  s3 = 3;
+  ss.str("");
+  reads = 0;
+  flp.FlushStates();
+  CHECK_EQ(ss.str(), "R(44) s1: 1\nR(44) s2: 2\nR(44) s3: 3\n");
+  CHECK_EQ(reads, 1);
+
+  // the interval of Tick is in the unit of the source
+  s1 = 5;
+  flp.Tick();
+  CHECK_EQ(ss.str().find("s1: 5"), std::string::npos);
+  ticks += 10;
+  flp.Tick();
+  CHECK_NE(ss.str().find("R(56) s1: 5\n"), std::string::npos);
+
+  {
+    LineProtocol::TimestampBatch batch(flp);
+    ss.str("");
+    flp.Respond("a", "x");
+    flp.Respond("b", "y");
+    CHECK_EQ(ss.str(), "R(57) a: x\nR(57) b: y\n");
+  }
+  flp.SetTimestampSource(nullptr);
+  ss.str("");
+  flp.Respond("a", "x");
+  CHECK(std::regex_match(ss.str(), std::regex(R"(R\(\d{10,}\) a: x\n)")));
+}
+
+TEST_CASE("Buffered output with a non-blocking writer") {
+  LineProtocol flp;
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  std::string written;
+  // a socket that takes at most 10 bytes per call
+  flp.SetBufferedOutput(
+      [&](const char* data, size_t len) {
+        len = std::min<size_t>(len, 10);
+        written.append(data, len);
+        return len;
+      },
+      {256, OutputFlushPolicy::kThreshold, 32, false});
+  flp.Respond("a", "1");
+  flp.Respond("b", "2");
+  CHECK(written.empty());
+  CHECK_EQ(flp.GetBufferedOutput().Pending(), 20);
+  // reaching the threshold starts the write
+  flp.Respond("c", "3");
+  flp.Respond("d", "4");
+  CHECK_EQ(written, "R(0) a: 1\n");
+  while (!flp.FlushOutput()) {
+  }
+  CHECK_EQ(written, "R(0) a: 1\nR(0) b: 2\nR(0) c: 3\nR(0) d: 4\n");
+
+  // only Tick writes with the tick policy
+  written.clear();
+  flp.SetBufferedOutput([&](const char* data, size_t len) {
+    written.append(data, len);
+    return len;
+  }, {256, OutputFlushPolicy::kTick, 0, false});
+  for (int i = 0; i < 10; ++i) {
+    flp.Respond("a", "1");
+  }
+  CHECK(written.empty());
+  flp.Tick();
+  CHECK_EQ(written.size(), 100);
+}
+
+TEST_CASE("Buffered output with an asynchronous writer") {
+  LineProtocol flp;
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  std::string transfer;
+  size_t n_transfers = 0;
+  // a DMA transfer, the bytes stay in the buffer until it completes
+  flp.SetBufferedOutput(
+      [&](const char* data, size_t len) {
+        transfer.assign(data, len);
+        ++n_transfers;
+        return len;
+      },
+      {FLP_RESPONSE_BUFFER_SIZE + 20, OutputFlushPolicy::kThreshold, 1, true});
+  flp.Respond("a", "1");
+  CHECK_EQ(transfer, "R(0) a: 1\n");
+  // collected while the transfer is in flight
+  for (int i = 0; i < 14; ++i) {
+    flp.Respond("b", "2");
+  }
+  CHECK_EQ(n_transfers, 1);
+  CHECK(flp.GetBufferedOutput().IsBackpressured());
+  // no room left in either buffer
+  flp.Respond("c", "3");
+  CHECK_EQ(flp.GetBufferedOutput().GetDroppedBytes(), 10);
+  CHECK_EQ(flp.GetBufferedOutput().Pending(), 150);
+
+  flp.CompleteOutput();
+  CHECK_EQ(n_transfers, 2);
+  CHECK_EQ(transfer.size(), 140);
+  CHECK_EQ(transfer.find("c: 3"), std::string::npos);
+  flp.CompleteOutput();
+  CHECK(flp.FlushOutput());
+  CHECK_EQ(flp.GetBufferedOutput().Pending(), 0);
+}
+
+TEST_CASE("Buffered output of responses larger than the buffers") {
+  LineProtocol flp;
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.RegisterInternalCommands();
+  int arg = 0;
+  for (int i = 0; i < 20; ++i) {
+    flp.RegisterCommand("motor" + std::to_string(i) + ".set", {{"speed", ArgumentSpec(arg)}}, nullptr);
+  }
+  std::stringstream ss;
+  flp.SetOStream(ss);
+  CHECK(flp.ValidateApply("@flp.cmd_reg"));
+  auto expected = ss.str();
+  REQUIRE_GT(expected.size(), BufferedOutputConfig{}.capacity);
+
+  // an idle writer receives the response in pieces
+  std::string written;
+  flp.SetBufferedOutput([&](const char* data, size_t len) {
+    written.append(data, len);
+    return len;
+  });
+  CHECK(flp.ValidateApply("@flp.cmd_reg"));
+  CHECK(flp.FlushOutput());
+  CHECK_EQ(written, expected);
+  CHECK_EQ(flp.GetBufferedOutput().GetDroppedBytes(), 0);
+
+  // a busy writer: the responses that do not fit are dropped as a whole
+  bool busy = true;
+  written.clear();
+  flp.SetBufferedOutput(
+      [&](const char* data, size_t len) {
+        if (busy) {
+          return size_t{0};
+        }
+        written.append(data, len);
+        return len;
+      },
+      {64, OutputFlushPolicy::kThreshold, 64, false});
+  std::string message(30, 'x');
+  flp.Respond("a", "1");
+  flp.Respond("b", message);
+  // the finished responses are handed over, the start of this one stays back
+  flp.Respond("c", message);
+  flp.Respond("d", message);
+  CHECK_EQ(flp.GetBufferedOutput().GetDroppedBytes(), 39);
+  busy = false;
+  while (!flp.FlushOutput()) {
+  }
+  CHECK_EQ(written, "R(0) a: 1\nR(0) b: " + message + "\nR(0) c: " + message + "\n");
+
+  // a response that went out in part is cut short but still terminated
+  busy = true;
+  written.clear();
+  CHECK(flp.ValidateApply("@flp.cmd_reg"));
+  CHECK_EQ(flp.GetBufferedOutput().GetTruncatedCount(), 1);
+  flp.Respond("e", "5");
+  busy = false;
+  while (!flp.FlushOutput()) {
+  }
+  CHECK_EQ(written, expected.substr(0, 64) + "\nR(0) e: 5\n");
+}
+
+TEST_CASE("Deadband of state reports") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  ExchangeState<float> a(flp, "a");
+  a.deadband = 0.5;
+  a = 1.0f;
+  a = 1.2f;
+  a = 1.5f;
+  a = 1.6f;
+  a = 1.2f;
+  CHECK(std::regex_match(ss.str(), std::regex(R"(R\(\d+\) a: 1\nR\(\d+\) a: 1.6\n)")));
+
+  ss.str("");
+  a.deadband = 0;
+  a = 1.6f;
+  a = 1.6f;
+  CHECK(ss.str().empty());
+  a = 1.7f;
+  CHECK_FALSE(ss.str().empty());
+}
+// Encode a binary frame with the writer of the responses.
+template <typename F>
+std::string EncodeFrame(F&& write) {
+  std::string frame;
+  OutputSink sink = [&](const char* data, size_t len) { frame.append(data, len); };
+  char buf[16];
+  ResponseWriter writer(buf, sizeof(buf), sink, true);
+  write(writer);
+  writer.End();
+  return frame;
+}
+
+// Decode the COBS frames of the output.
+std::vector<std::string> DecodeFrames(const std::string& out) {
+  std::vector<std::string> frames;
+  size_t start = 0;
+  for (size_t end; (end = out.find('\0', start)) != std::string::npos; start = end + 1) {
+    std::string frame = out.substr(start, end - start);
+    auto len = CobsDecode(frame.data(), frame.size());
+    REQUIRE_NE(len, SIZE_MAX);
+    frame.resize(len);
+    frames.push_back(frame);
+  }
+  return frames;
+}
+
+TEST_CASE("COBS framing round trip") {
+  for (size_t size : {0, 1, 253, 254, 255, 600}) {
+    std::string payload;
+    for (size_t i = 0; i < size; ++i) {
+      payload += static_cast<char>(i % 7 == 0 ? 0 : i % 256 == 0 ? 1 : i % 256);
+    }
+    auto frame = EncodeFrame([&](ResponseWriter& writer) { writer.Write(payload); });
+    CHECK_EQ(frame.back(), '\0');
+    CHECK_EQ(frame.find('\0'), frame.size() - 1);
+    auto frames = DecodeFrames(frame);
+    REQUIRE_EQ(frames.size(), 1);
+    CHECK_EQ(frames[0], payload);
+  }
+  char malformed[] = {3, 1};
+  CHECK_EQ(CobsDecode(malformed, sizeof(malformed)), SIZE_MAX);
+}
+
+TEST_CASE("Binary framing mode") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.RegisterInternalCommands();
+  flp.SetOStream(ss);
+  float speed = 0;
+  int dir = 0;
+  int call_count = 0;
+  flp.RegisterCommand("motor.set",
+                      {{"speed", ArgumentSpec(speed)},
+                       {"dir", ArgumentSpec(dir, false)}},
+                      [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+                        CHECK_EQ(matched.count("dir"), 1);
+                        call_count++;
+                      });
+  ExchangeState<int> position(flp, "position");
+
+  flp.Feed("@flp.binary.schema\n");
+  CHECK(flp.Process());
+  CHECK_NE(ss.str().find(R"("motor.set":{"id":)"), std::string::npos);
+  CHECK_NE(ss.str().find(R"("args":{"dir":0,"speed":1})"), std::string::npos);
+  CHECK_NE(ss.str().find(R"("states":{"position":0})"), std::string::npos);
+
+  ss.str("");
+  flp.Feed("@flp.binary\n");
+  CHECK(flp.Process());
+  CHECK(std::regex_match(ss.str(), std::regex(R"(_\(\d+\) @flp\.binary: OK\n)")));
+  CHECK(flp.IsBinaryMode());
+
+  auto& schema = flp.GetBinarySchema();
+  uint16_t motor_set = 0, binary = 0;
+  for (uint16_t i = 0; i < schema.commands.size(); ++i) {
+    if (schema.commands[i].qualifier == "motor.set") motor_set = i;
+    if (schema.commands[i].qualifier == "@flp.binary") binary = i;
+  }
+
+  flp.Feed(EncodeFrame([&](ResponseWriter& writer) {
+    writer.WriteLE(motor_set);
+    writer.Write('\1');
+    writer.WriteBinaryValue(2.5f);
+    writer.Write('\0');
+    writer.WriteBinaryValue(-1);
+  }));
+  CHECK(flp.Process());
+  CHECK_EQ(speed, 2.5);
+  CHECK_EQ(dir, -1);
+  CHECK_EQ(call_count, 1);
+
+  // the same validation as the text commands
+  flp.Feed(EncodeFrame([&](ResponseWriter& writer) {
+    writer.WriteLE(motor_set);
+    writer.Write('\0');
+    writer.WriteBinaryValue(1.5f);
+  }));
+  CHECK_THROWS_AS(flp.Process(), InvalidArgumentError);
+  flp.Feed(EncodeFrame([&](ResponseWriter& writer) {
+    writer.WriteLE(motor_set);
+    writer.Write('\1');
+    writer.WriteBinaryValue(1.5f);
+  }));
+  CHECK_THROWS_AS(flp.Process(), InvalidArgumentError);
+  flp.Feed(EncodeFrame([&](ResponseWriter& writer) { writer.WriteLE(static_cast<uint16_t>(1000)); }));
+  CHECK_THROWS_AS(flp.Process(), UnknownQualifierError);
+  flp.Feed(std::string("\x05\x01\x00", 3));
+  CHECK_THROWS_AS(flp.Process(), InvalidArgumentError);
+  CHECK_EQ(call_count, 1);
+
+  // state reports and responses are frames
+  ss.str("");
+  position = 300;
+  flp.Respond("channel", "message", '_');
+  auto frames = DecodeFrames(ss.str());
+  REQUIRE_EQ(frames.size(), 2);
+  REQUIRE_EQ(frames[0].size(), 13);
+  CHECK_EQ(frames[0][0], 'R');
+  CHECK_EQ(frames[0][5], 1);
+  CHECK_EQ(ReadLE<uint16_t>(&frames[0][6]), 0);
+  CHECK_EQ(frames[0][8], static_cast<char>(BinaryType::kInt32));
+  CHECK_EQ(ReadLE<int32_t>(&frames[0][9]), 300);
+  CHECK_EQ(frames[1][0], '_');
+  CHECK_EQ(frames[1][5], 0);
+  CHECK_EQ(frames[1].substr(6), "\x07" "channelmessage");
+
+  // switch back to text
+  ss.str("");
+  flp.Feed(EncodeFrame([&](ResponseWriter& writer) {
+    writer.WriteLE(binary);
+    writer.Write('\0');
+    writer.WriteBinaryValue(false);
+  }));
+  CHECK(flp.Process());
+  CHECK_FALSE(flp.IsBinaryMode());
+  frames = DecodeFrames(ss.str());
+  REQUIRE_EQ(frames.size(), 1);
+  CHECK_EQ(frames[0].substr(6), "\x0b" "@flp.binaryOK");
+  flp.Feed("motor.set dir=2\n");
+  CHECK(flp.Process());
+  CHECK_EQ(dir, 2);
+}
+#if FLP_ENABLE_STATS
+TEST_CASE("Statistics of the hot paths") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.RegisterInternalCommands();
+  flp.SetOStream(ss);
+  int arg = 0;
+  flp.RegisterCommand("test", {{"arg", ArgumentSpec(arg)}}, nullptr);
+  const std::string input = "test arg=1\ntest arg=x\nnope\n";
+  flp.Feed(input);
+  auto summary = flp.ProcessAll();
+  CHECK_EQ(summary.failed, 2);
+
+  auto& stats = flp.GetStats();
+  CHECK_EQ(stats.commands.processed, 3);
+  CHECK_EQ(stats.commands.failed, 2);
+  CHECK_EQ(stats.bytes_in, input.size());
+  CHECK_EQ(stats.buffer_high_water, input.size());
+  size_t n_parse = 0, n_dispatch = 0;
+  for (size_t i = 0; i < TimeHistogram::kBuckets; ++i) {
+    n_parse += stats.parse_time.buckets[i];
+    n_dispatch += stats.dispatch_time.buckets[i];
+  }
+  CHECK_EQ(n_parse, 3);
+  // only the valid command reached the dispatch
+  CHECK_EQ(n_dispatch, 1);
+
+  ExchangeState<int> state(flp, "state");
+  state.deadband = 5;
+  state = 1;
+  state = 3;
+  state = 10;
+  CHECK_EQ(stats.reports_emitted, 2);
+  CHECK_EQ(stats.reports_suppressed, 1);
+  CHECK_EQ(stats.bytes_out, ss.str().size());
+
+  ss.str("");
+  const std::string stats_command = "@flp.stats reset=1\n";
+  flp.Feed(stats_command);
+  CHECK(flp.Process());
+  auto out = ss.str();
+  CHECK_NE(out.find("@flp.stats: processed=3 failed=2 bytes_in=" + std::to_string(input.size() + stats_command.size())), std::string::npos);
+  CHECK_NE(out.find("reports=2 suppressed=1 parse_ns="), std::string::npos);
+  CHECK_NE(out.find("@flp.stats: test processed=2 failed=1\n"), std::string::npos);
+  // the reset command itself is counted after the reset
+  CHECK_EQ(stats.commands.processed, 1);
+  CHECK_EQ(stats.reports_emitted, 0);
+}
+#endif
+#if FLP_ENABLE_CONCURRENCY
+TEST_CASE("Output queue keeps the messages whole") {
+  MpscOutputQueue queue(4);
+  std::string message(100, 'a');
+  for (size_t i = 0; i < message.size(); ++i) {
+    message[i] = static_cast<char>('a' + i % 26);
+  }
+  CHECK(queue.Push(message.data(), message.size()));
+  CHECK_FALSE(queue.Push("x", 1));
+  std::string out;
+  CHECK_EQ(queue.Drain([&](const char* data, size_t len) { out.append(data, len); }), message.size());
+  CHECK_EQ(out, message);
+  // larger than the whole queue
+  std::string large(200, 'b');
+  CHECK_FALSE(queue.Push(large.data(), large.size()));
+  CHECK_EQ(queue.GetDroppedCount(), 2);
+  CHECK(queue.Push("x", 1));
+}
+
+TEST_CASE("Concurrent input and output") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.EnableInputQueue(64);
+  flp.EnableOutputQueue(4096);
+  int arg = 0;
+  int64_t sum = 0;
+  int call_count = 0;
+  flp.RegisterCommand("test", {{"arg", ArgumentSpec(arg)}}, [&](const RawArgumentMap& matched, const RawArgumentMap& unmatched) {
+    sum += arg;
+    call_count++;
+  });
+
+  const int kLines = 2000;
+  std::thread rx([&]() {
+    std::string input;
+    for (int i = 1; i <= kLines; ++i) {
+      input += "test arg=" + std::to_string(i) + "\n";
+    }
+    // uneven chunks, the queue is smaller than the input
+    for (size_t pos = 0, chunk = 1; pos < input.size(); chunk = chunk % 23 + 1) {
+      pos += flp.QueueInput(input.data() + pos, std::min(chunk, input.size() - pos));
+    }
+  });
+
+  const int kWorkers = 4;
+  const int kMessages = 300;
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<ExchangeState<int>>> states;
+  for (int w = 0; w < kWorkers; ++w) {
+    states.push_back(std::make_unique<ExchangeState<int>>(flp, "s" + std::to_string(w)));
+  }
+  for (int w = 0; w < kWorkers; ++w) {
+    workers.emplace_back([&, w]() {
+      auto channel = "w" + std::to_string(w);
+      for (int i = 1; i <= kMessages; ++i) {
+        flp.Respond(channel, std::to_string(i));
+        *states[w] = i;
+      }
+    });
+  }
+  while (call_count < kLines) {
+    flp.Process();
+  }
+  rx.join();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  flp.DrainOutput();
+  CHECK_EQ(sum, int64_t{kLines} * (kLines + 1) / 2);
+  CHECK_EQ(flp.GetDroppedOutputCount(), 0);
+
+  // the messages of each thread arrive whole and in order
+  std::vector<int> last_response(kWorkers, 0), last_report(kWorkers, 0);
+  std::string line;
+  std::regex reg(R"(R\(0\) (w|s)(\d): (\d+))");
+  size_t n_lines = 0;
+  while (std::getline(ss, line)) {
+    std::smatch m;
+    REQUIRE(std::regex_match(line, m, reg));
+    auto& last = m[1] == "w" ? last_response : last_report;
+    int value = std::stoi(m[3]);
+    CHECK_EQ(value, last[std::stoi(m[2])] + 1);
+    last[std::stoi(m[2])] = value;
+    ++n_lines;
+  }
+  CHECK_EQ(n_lines, 2 * kWorkers * kMessages);
+  for (int w = 0; w < kWorkers; ++w) {
+    CHECK_EQ(states[w]->Get(), kMessages);
+  }
+}
+TEST_CASE("Asynchronous commands completed by a worker thread") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.EnableOutputQueue(1024);
+  std::vector<std::thread> workers;
+  flp.RegisterCommand("flash.write", {}, [&](const CommandArguments&, CompletionToken token) {
+    workers.emplace_back([token]() mutable { token.Complete(); });
+  });
+  const int kCommands = 64;
+  for (int i = 0; i < kCommands; ++i) {
+    // the slots free up as the workers complete
+    while (flp.GetInflightCount() == FLP_MAX_INFLIGHT) {
+      std::this_thread::yield();
+    }
+    CHECK(flp.ValidateApply("flash.write"));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  flp.DrainOutput();
+  CHECK_EQ(flp.GetInflightCount(), 0);
+  size_t responses = 0;
+  for (std::string line; std::getline(ss, line);) {
+    CHECK_EQ(line, "_(0) flash.write: OK");
+    ++responses;
+  }
+  CHECK_EQ(responses, kCommands);
+}
+TEST_CASE("Asynchronous command failed by a std::thread") {
+  std::stringstream ss;
+  LineProtocol flp;
+  flp.SetOStream(ss);
+  flp.SetTimestampSource([]() { return int64_t{0}; });
+  flp.EnableOutputQueue(64);
+  CompletionToken pending;
+  flp.RegisterCommand("flash.erase", {}, [&](const CommandArguments&, CompletionToken token) { pending = token; });
+  CHECK(flp.ValidateApply("flash.erase"));
+  CHECK_EQ(flp.GetInflightCount(), 1);
+  bool failed = false;
+  std::thread worker([&]() { failed = pending.Fail("locked"); });
+  worker.join();
+  CHECK(failed);
+  CHECK_FALSE(pending.Complete());
+  // the response waits in the queue until the loop thread drains it
+  CHECK_EQ(ss.str(), "");
+  flp.DrainOutput();
+  CHECK_EQ(ss.str(), "E(0) flash.erase: locked\n");
+  CHECK_EQ(flp.GetInflightCount(), 0);
+}
+#endif
 #pragma clang diagnostic pop
\ No newline at end of file